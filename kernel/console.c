@@ -74,13 +74,17 @@ consolewrite(int user_src, uint64 src, int n)
 
   return guest_consolewrite(src, n, 0);
 #else
-  int i;
-
-  for(i = 0; i < n; i++){
-    char c;
-    if(either_copyin(&c, user_src, src+i, 1) == -1)
+  char buf[128];
+  int i, m;
+
+  // hand the uart a chunk at a time, not a byte.
+  for(i = 0; i < n; i += m){
+    m = n - i;
+    if(m > sizeof(buf))
+      m = sizeof(buf);
+    if(either_copyin(buf, user_src, src+i, m) == -1)
       break;
-    uartputc(c);
+    uartwrite(buf, m);
   }
 
   return i;
@@ -116,6 +120,12 @@ consoleread(int user_dst, uint64 dst, int n)
         release(&cons.lock);
         return -1;
       }
+      if(vmstopping(myproc())){
+        // a guest is being stopped: hand back what it has
+        // read, or -1 so that it asks again later.
+        release(&cons.lock);
+        return n < target ? target - n : -1;
+      }
       sleep(&cons.r, &cons.lock);
     }
 
@@ -32,9 +32,9 @@ struct file*    filealloc(void);
 void            fileclose(struct file*);
 struct file*    filedup(struct file*);
 void            fileinit(void);
-int             fileread(struct file*, uint64, int n);
+int             fileread(struct file*, int, uint64, int n);
 int             filestat(struct file*, uint64 addr);
-int             filewrite(struct file*, uint64, int n);
+int             filewrite(struct file*, int, uint64, int n);
 
 // fs.c
 void            fsinit(int);
@@ -65,6 +65,11 @@ void            ramdiskrw(struct buf*);
 void*           kalloc(void);
 void            kfree(void *);
 void            kinit(void);
+int             kallocn(uint64*, int);
+void            kdup(void *);
+int             kref(void *);
+int             kfreepages(void);
+void            balloonpoll(void);
 
 // log.c
 void            initlog(int, struct superblock*);
@@ -75,8 +80,8 @@ void            end_op(void);
 // pipe.c
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
-int             piperead(struct pipe*, uint64, int);
-int             pipewrite(struct pipe*, uint64, int);
+int             piperead(struct pipe*, int, uint64, int);
+int             pipewrite(struct pipe*, int, uint64, int);
 
 // printf.c
 void            printf(char*, ...);
@@ -91,7 +96,10 @@ int             growproc(int);
 void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
+void            proc_tlbchanged(struct proc*);
 int             kill(int);
+int             setnice(int, int);
+int             procinfo(uint64, int);
 int             killed(struct proc*);
 void            setkilled(struct proc*);
 struct cpu*     mycpu(void);
@@ -100,6 +108,8 @@ struct proc*    myproc();
 void            procinit(void);
 void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
+void            setrunnable(struct proc*);
+void            kick(int);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
 int             wait(uint64);
@@ -116,6 +126,8 @@ void            swtch(struct context*, struct context*);
 void            acquire(struct spinlock*);
 int             holding(struct spinlock*);
 void            initlock(struct spinlock*, char*);
+void            freelock(struct spinlock*);
+int             lockstats(uint64, int);
 void            release(struct spinlock*);
 void            push_off(void);
 void            pop_off(void);
@@ -143,8 +155,15 @@ int             fetchstr(uint64, char*, int);
 int             fetchaddr(uint64, uint64*);
 void            syscall();
 
+// sysfile.c
+int             argfd(int, int*, struct file**);
+
 // trap.c
 extern uint     ticks;
+uint            tickupdate(void);
+void            clockat(uint64);
+void            timerarm(void);
+void            timeridle(void);
 void            trapinit(void);
 void            trapinithart(void);
 extern struct spinlock tickslock;
@@ -154,10 +173,12 @@ void            usertrapret(void);
 void            uartinit(void);
 void            uartintr(void);
 void            uartputc(int);
+void            uartwrite(char*, int);
 void            uartputc_sync(int);
 int             uartgetc(void);
 
 // vm.c
+extern int      useasid;
 void            kvminit(void);
 void            kvminithart(void);
 void            kvmmap(pagetable_t, uint64, uint64, uint64, int);
@@ -169,8 +190,11 @@ uint64          uvmdealloc(pagetable_t, uint64, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
+void            uvmunmapsparse(pagetable_t, uint64, uint64, int);
+int             uvmlazy(pagetable_t, uint64, uint64);
 void            uvmclear(pagetable_t, uint64);
 pte_t *         walk(pagetable_t, uint64, int);
+pte_t *         walklevel(pagetable_t, uint64, int, int);
 uint64          walkaddr(pagetable_t, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
@@ -190,5 +214,29 @@ void            virtio_disk_intr(void);
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
 
+// vma.c
+void            vmainit(void);
+struct vma*     vmalookup(struct proc*, uint64);
+int             vmaoverlap(struct proc*, uint64, uint64);
+uint64          vmafault(pagetable_t, uint64, int);
+uint64          vmammap(struct proc*, uint64, uint64, int, int, struct file*, uint);
+int             vmaunmap(struct proc*, uint64, uint64);
+int             vmadup(struct proc*, struct proc*);
+void            vmaclear(pagetable_t, struct vma*, int);
+uint64          textpage(struct inode*, uint, uint);
+uint64          sharedpage(struct inode*, uint);
+void            textinval(struct inode*);
+void            textwrite(struct inode*, uint, uint, uint64);
+void            textreclaim(void);
+
 // vmm.c
 void            vmminit(void);
+void            vmminithart(void);
+void            guestdrop(struct proc*);
+int             vmstopping(struct proc*);
+void            guestfree(struct proc*);
+
+// ksm.c
+void            ksmstart(void);
+int             ksmpages(void);
+int             ksmfault(pagetable_t, uint64);
@@ -6,10 +6,9 @@
 #include "proc.h"
 #include "defs.h"
 #include "elf.h"
-
-static
-__attribute__((unused))
-int loadseg(pde_t *, uint64, struct inode *, uint, uint);
+#include "fs.h"
+#include "sleeplock.h"
+#include "file.h"
 
 int flags2perm(int flags)
 {
@@ -33,9 +32,13 @@ exec(char *path, char **argv)
   struct elfhdr elf;
   struct inode *ip;
   struct proghdr ph;
+  struct vma vma[NVMA];
+  int nvma = 0;
   pagetable_t pagetable = 0, oldpagetable;
   struct proc *p = myproc();
 
+  memset(vma, 0, sizeof(vma));
+
   begin_op();
 
   if((ip = namei(path)) == 0){
@@ -54,7 +57,8 @@ exec(char *path, char **argv)
   if((pagetable = proc_pagetable(p)) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Describe the program's segments. Nothing is read yet;
+  // vmafault() brings pages in from ip as they are touched.
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
@@ -66,12 +70,24 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
-    uint64 sz1;
-    if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz, flags2perm(ph.flags))) == 0)
+    if(ph.vaddr < PGROUNDUP(sz) || ph.vaddr + ph.memsz >= TRAPFRAME)
+      goto bad;
+    if(ph.off + ph.filesz < ph.off || ph.off + ph.filesz > ip->size)
+      goto bad;
+    if(ph.memsz == 0)
+      continue;
+    if(nvma >= NVMA)
       goto bad;
-    sz = sz1;
-    if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if(uvmlazy(pagetable, PGROUNDUP(sz), (PGROUNDUP(ph.vaddr + ph.memsz) - PGROUNDUP(sz)) / PGSIZE) < 0)
       goto bad;
+    vma[nvma].addr = ph.vaddr;
+    vma[nvma].len = ph.memsz;
+    vma[nvma].filesz = ph.filesz;
+    vma[nvma].off = ph.off;
+    vma[nvma].perm = PTE_R | PTE_U | flags2perm(ph.flags);
+    vma[nvma].ip = idup(ip);
+    nvma++;
+    sz = ph.vaddr + ph.memsz;
   }
   iunlockput(ip);
   end_op();
@@ -131,6 +147,9 @@ exec(char *path, char **argv)
   p->sz = sz;
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
+  proc_tlbchanged(p);
+  vmaclear(oldpagetable, p->vma, NVMA);
+  memmove(p->vma, vma, sizeof(vma));
   proc_freepagetable(oldpagetable, oldsz);
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
@@ -142,31 +161,7 @@ exec(char *path, char **argv)
     iunlockput(ip);
     end_op();
   }
+  vmaclear(0, vma, NVMA);  // exec's regions never use the page table
   return -1;
 #endif
 }
-
-// Load a program segment into pagetable at virtual address va.
-// va must be page-aligned
-// and the pages from va to va+sz must already be mapped.
-// Returns 0 on success, -1 on failure.
-static int
-loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz)
-{
-  uint i, n;
-  uint64 pa;
-
-  for(i = 0; i < sz; i += PGSIZE){
-    pa = walkaddr(pagetable, va + i);
-    if(pa == 0)
-      panic("loadseg: address should exist");
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if(readi(ip, 0, (uint64)pa, offset+i, n) != n)
-      return -1;
-  }
-  
-  return 0;
-}
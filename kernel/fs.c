@@ -271,6 +271,7 @@ iget(uint dev, uint inum)
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->text = 1;  // the cache may outlive an inode's slot
   release(&itable.lock);
 
   return ip;
@@ -429,6 +430,9 @@ itrunc(struct inode *ip)
   struct buf *bp;
   uint *a;
 
+  if(ip->text)
+    textinval(ip);
+
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
       bfree(ip->dev, ip->addrs[i]);
@@ -530,6 +534,10 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
   if(off > ip->size)
     ip->size = off;
 
+  // running programs may share cached copies of this file.
+  if(ip->text)
+    textwrite(ip, off - tot, tot, user_src ? 0 : src - tot);
+
   // write the i-node back to disk even if the size didn't change
   // because the loop above might have called bmap() and added a new
   // block to ip->addrs[].
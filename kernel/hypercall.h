@@ -3,3 +3,6 @@
 #define HC_consolewrite 2
 #define HC_consoleread 3
 #define HC_memsize  4
+#define HC_balloon_target  5
+#define HC_balloon_inflate 6
+#define HC_balloon_deflate 7
@@ -15,6 +15,10 @@ sub entry {
     print " ret\n";
 }
 
+entry("mhartid");
 entry("consolewrite");
 entry("consoleread");
 entry("memsize");
+entry("balloon_target");
+entry("balloon_inflate");
+entry("balloon_deflate");
@@ -18,15 +18,25 @@ struct run {
   struct run *next;
 };
 
+// the most physical memory either the host or a guest kernel
+// will ever manage, for sizing the page reference counts.
+#define KMAXPAGES ((128*1024*1024) / PGSIZE)
+#define PA2REF(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+
 struct {
   struct spinlock lock;
   struct run *freelist;
+  int nfree;             // pages on freelist
+  ushort ref[KMAXPAGES]; // number of mappings/owners of each page
 } kmem;
 
 #ifdef VMM_GUEST
 uint64 guest_phystop;
 
 extern uint64 guest_memsize(void);
+extern uint64 guest_balloon_target(void);
+extern int guest_balloon_inflate(uint64 gpa, int n);
+extern int guest_balloon_deflate(uint64 gpa, int n);
 #endif
 
 void
@@ -44,14 +54,18 @@ freerange(void *pa_start, void *pa_end)
 {
   char *p;
   p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
+  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE){
+    kmem.ref[PA2REF(p)] = 1;
     kfree(p);
+  }
 }
 
-// Free the page of physical memory pointed at by pa,
+// Drop a reference to the page of physical memory pointed at by pa,
 // which normally should have been returned by a
 // call to kalloc().  (The exception is when
 // initializing the allocator; see kinit above.)
+// The page goes back on the free list when the last
+// reference is dropped.
 void
 kfree(void *pa)
 {
@@ -60,6 +74,15 @@ kfree(void *pa)
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  acquire(&kmem.lock);
+  if(kmem.ref[PA2REF(pa)] < 1)
+    panic("kfree: ref");
+  if(--kmem.ref[PA2REF(pa)] > 0){
+    release(&kmem.lock);
+    return;
+  }
+  release(&kmem.lock);
+
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
 
@@ -68,6 +91,7 @@ kfree(void *pa)
   acquire(&kmem.lock);
   r->next = kmem.freelist;
   kmem.freelist = r;
+  kmem.nfree++;
   release(&kmem.lock);
 }
 
@@ -80,12 +104,184 @@ kalloc(void)
   struct run *r;
 
   acquire(&kmem.lock);
+#ifndef VMM_GUEST
+  if(kmem.freelist == 0){
+    // out of memory: let go of cached program text
+    // that no process is using, and try again.
+    release(&kmem.lock);
+    textreclaim();
+    acquire(&kmem.lock);
+  }
+#endif
   r = kmem.freelist;
-  if(r)
+  if(r){
     kmem.freelist = r->next;
+    kmem.nfree--;
+    kmem.ref[PA2REF(r)] = 1;
+  }
   release(&kmem.lock);
 
   if(r)
     memset((char*)r, 5, PGSIZE); // fill with junk
   return (void*)r;
 }
+
+// Allocate up to n pages at once, into pa[] in address
+// order, so that the caller can find the physically contiguous
+// runs among them. Unlike kalloc()'s, the pages are not filled
+// with junk: the caller must write every byte of them.
+// Returns the number of pages allocated.
+int
+kallocn(uint64 *pa, int n)
+{
+  struct run *r;
+  uint64 x;
+  int i, j;
+
+  acquire(&kmem.lock);
+#ifndef VMM_GUEST
+  if(kmem.nfree < n){
+    release(&kmem.lock);
+    textreclaim();
+    acquire(&kmem.lock);
+  }
+#endif
+  for(i = 0; i < n && (r = kmem.freelist) != 0; i++){
+    kmem.freelist = r->next;
+    kmem.nfree--;
+    kmem.ref[PA2REF(r)] = 1;
+    pa[i] = (uint64)r;
+  }
+  release(&kmem.lock);
+  n = i;
+
+  for(i = 1; i < n; i++){
+    x = pa[i];
+    for(j = i; j > 0 && pa[j-1] > x; j--)
+      pa[j] = pa[j-1];
+    pa[j] = x;
+  }
+  return n;
+}
+
+// Add a reference to a page returned by kalloc(),
+// so that it is shared until each holder kfree()s it.
+void
+kdup(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kdup");
+
+  acquire(&kmem.lock);
+  if(kmem.ref[PA2REF(pa)] < 1)
+    panic("kdup: ref");
+  kmem.ref[PA2REF(pa)]++;
+  release(&kmem.lock);
+}
+
+// The number of references to a page returned by kalloc().
+int
+kref(void *pa)
+{
+  int n;
+
+  acquire(&kmem.lock);
+  n = kmem.ref[PA2REF(pa)];
+  release(&kmem.lock);
+  return n;
+}
+
+// The number of free pages.
+int
+kfreepages(void)
+{
+  return kmem.nfree;
+}
+
+#ifdef VMM_GUEST
+// Memory ballooning: give free pages back to the host when it
+// asks for them, and take them back when it relents. The
+// host says how many pages it wants (HC_balloon_target); the
+// guest keeps BALLOON_RESERVE free pages for itself whatever
+// the host wants. Ballooned pages are unmapped by the host,
+// so which ones they are is kept here, in ballooned[].
+#define BALLOON_BATCH   64
+#define BALLOON_RESERVE 256
+
+static uchar ballooned[KMAXPAGES/8];
+static int nballoon;
+static uint64 batch[BALLOON_BATCH];
+
+static void
+inflate(int target)
+{
+  struct run *r;
+  int i, n, done;
+
+  while(nballoon < target){
+    n = 0;
+    acquire(&kmem.lock);
+    while(n < BALLOON_BATCH && nballoon + n < target &&
+          kmem.nfree > BALLOON_RESERVE){
+      r = kmem.freelist;
+      kmem.freelist = r->next;
+      kmem.nfree--;
+      batch[n++] = (uint64)r;
+    }
+    release(&kmem.lock);
+    if(n == 0)
+      return;
+    done = guest_balloon_inflate((uint64)batch, n);
+    for(i = 0; i < n; i++){
+      if(i < done){
+        ballooned[PA2REF(batch[i])/8] |= 1 << (PA2REF(batch[i])%8);
+        kmem.ref[PA2REF(batch[i])] = 0;
+      } else {
+        kfree((void*)batch[i]);  // the host didn't take it
+      }
+    }
+    nballoon += done;
+    if(done < n)
+      return;
+  }
+}
+
+static void
+deflate(int target)
+{
+  int i, n, done;
+  static int next;  // where to look for ballooned pages
+
+  while(nballoon > target){
+    n = 0;
+    for(i = 0; i < KMAXPAGES && n < BALLOON_BATCH && nballoon - n > target; i++){
+      if(ballooned[next/8] & (1 << (next%8)))
+        batch[n++] = KERNBASE + (uint64)next*PGSIZE;
+      next = (next + 1) % KMAXPAGES;
+    }
+    if(n == 0)
+      return;
+    done = guest_balloon_deflate((uint64)batch, n);
+    for(i = 0; i < done; i++){
+      ballooned[PA2REF(batch[i])/8] &= ~(1 << (PA2REF(batch[i])%8));
+      kmem.ref[PA2REF(batch[i])] = 1;
+      kfree((void*)batch[i]);
+    }
+    nballoon -= done;
+    if(done < n)
+      return;  // the host is short of memory too
+  }
+}
+
+// called on each clock tick on CPU 0.
+void
+balloonpoll(void)
+{
+  int target = guest_balloon_target();
+
+  if(nballoon < target)
+    inflate(target);
+  else if(nballoon > target)
+    deflate(target);
+}
+#endif
@@ -0,0 +1,233 @@
+//
+// Same-page merging for guests. A kernel thread, ksmd, walks
+// every guest's second-stage page table a batch at a time and
+// maps pages with the same contents, across guests or within
+// one, to a single read-only copy. A store to a merged page
+// that was writable faults to ksmfault(), which gives the
+// guest its own copy again.
+//
+// A page is only made shareable once its hash has been seen
+// before, from another page or from the same page on an
+// earlier pass, so pages that change all the time stay
+// private. Merged contents live in ksm.page[], which holds a
+// reference to each; entries nothing else maps any more are
+// freed at the start of each pass.
+//
+// ksmd and the guests all run on CPU 0 only, so no guest runs
+// while ksmd holds a page's PTE in an intermediate state, and
+// one hfence.gvma on CPU 0 suffices. ksmd gets CPU 0 when a
+// guest yields at a timer exit, and then finds it out of any
+// hypercall, so running guests' pages get merged too. ^P shows
+// the host's free pages and how many pages ksmd has merged.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+
+#define NKSM      1024   // most distinct merged pages
+#define NSEEN     4096   // page hashes remembered
+#define KSM_BATCH 128    // pages looked at per wakeup
+#define KSM_HZ    20     // wakeups per second
+
+extern struct proc proc[NPROC];
+
+struct proc *ksmproc;
+
+struct {
+  int started;
+  int n;
+  struct {
+    uint64 pa;
+    uint hash;
+  } page[NKSM];          // merged pages, read-only wherever mapped
+  uint seen[NSEEN];      // hashes of pages looked at, by hash % NSEEN
+  int scan;              // index in proc[] of the guest being scanned
+  uint64 gpa;            // ... and the next page to look at
+} ksm;
+
+static uint
+pagehash(uint64 *w)
+{
+  uint64 h = 14695981039346656037UL;
+  int i;
+
+  for(i = 0; i < PGSIZE/8; i++){
+    h ^= w[i];
+    h *= 1099511628211UL;
+  }
+  return h ^ (h >> 32);
+}
+
+// free merged pages that no guest maps any more.
+static void
+ksmgc(void)
+{
+  int i;
+
+  for(i = 0; i < ksm.n; ){
+    if(kref((void*)ksm.page[i].pa) == 1){
+      kfree((void*)ksm.page[i].pa);
+      ksm.page[i] = ksm.page[--ksm.n];
+    } else {
+      i++;
+    }
+  }
+}
+
+// map *pte, for a page at pa, to the merged page at kpa.
+static void
+ksmmap(pte_t *pte, uint64 kpa)
+{
+  uint64 pa = PTE2PA(*pte);
+  int flags = PTE_FLAGS(*pte);
+
+  if(flags & PTE_W)
+    flags = (flags & ~PTE_W) | PTE_COW;
+  flags |= PTE_KSM;
+  kdup((void*)kpa);
+  *pte = PA2PTE(kpa) | flags;
+  hfence_gvma();
+  if(pa != kpa)
+    kfree((void*)pa);
+}
+
+// merge the guest page *pte maps with an identical one,
+// or make it shareable if its contents look stable.
+static void
+ksmpage(pte_t *pte)
+{
+  uint64 pa = PTE2PA(*pte);
+  uint h;
+  int i;
+
+  h = pagehash((uint64*)pa);
+  for(i = 0; i < ksm.n; i++){
+    if(ksm.page[i].hash == h && memcmp((void*)ksm.page[i].pa, (void*)pa, PGSIZE) == 0){
+      ksmmap(pte, ksm.page[i].pa);
+      return;
+    }
+  }
+  if(ksm.seen[h % NSEEN] != h){
+    ksm.seen[h % NSEEN] = h;
+    return;
+  }
+  if(ksm.n == NKSM)
+    return;
+  kdup((void*)pa);  // ksm.page[]'s reference
+  ksm.page[ksm.n].pa = pa;
+  ksm.page[ksm.n].hash = h;
+  ksm.n++;
+  ksmmap(pte, pa);
+  kfree((void*)pa);  // ksmmap() took another for the mapping
+}
+
+// look at up to n guest pages, carrying on from the last call.
+static void
+ksmscan(int n)
+{
+  struct proc *p;
+  pte_t *pte;
+
+  while(n-- > 0){
+    p = &proc[ksm.scan];
+    acquire(&p->lock);
+    // skip a guest still being loaded, or in a hypercall: it
+    // may be using a page's address, with interrupts on; or
+    // one that vmsave() is reading.
+    if(p->vmid == 0 || p->state == USED || p->state == ZOMBIE ||
+       p->inhc || p->vmstop || ksm.gpa >= KERNBASE + p->sz){
+      release(&p->lock);
+      ksm.gpa = KERNBASE;
+      if(++ksm.scan == NPROC){
+        ksm.scan = 0;
+        ksmgc();
+      }
+      continue;
+    }
+    // read-only pages come from the text cache, and are
+    // shared already.
+    pte = walk(p->stage_pagetable, ksm.gpa, 0);
+    if(pte && (*pte & (PTE_V|PTE_W|PTE_KSM)) == (PTE_V|PTE_W))
+      ksmpage(pte);
+    ksm.gpa += PGSIZE;
+    release(&p->lock);
+  }
+}
+
+static void
+ksmd(void)
+{
+  uint64 deadline;
+
+  // Still holding p->lock from scheduler.
+  release(&myproc()->lock);
+
+  for(;;){
+    ksmscan(KSM_BATCH);
+
+    deadline = r_time() + TIMEFREQ / KSM_HZ;
+    acquire(&tickslock);
+    while(r_time() < deadline){
+      clockat(deadline);
+      sleep(&ticks, &tickslock);
+    }
+    release(&tickslock);
+  }
+}
+
+// the number of distinct merged pages.
+int
+ksmpages(void)
+{
+  return ksm.n;
+}
+
+// start ksmd, once there is a guest for it to look at.
+void
+ksmstart(void)
+{
+  struct proc *p;
+
+  if(__sync_lock_test_and_set(&ksm.started, 1))
+    return;
+  if((p = allocproc()) == 0){
+    ksm.started = 0;
+    return;
+  }
+  ksm.gpa = KERNBASE;
+  p->context.ra = (uint64)ksmd;
+  p->nice = NICE_MAX;
+  safestrcpy(p->name, "ksmd", sizeof(p->name));
+  ksmproc = p;
+  setrunnable(p);
+  release(&p->lock);
+}
+
+// give a guest its own copy of the merged page at gpa, and
+// let it write there, after a store faulted or before the
+// host writes on its behalf. returns 0, or -1 if gpa isn't
+// a merged page that was writable, or memory is short.
+int
+ksmfault(pagetable_t pagetable, uint64 gpa)
+{
+  pte_t *pte;
+  uint64 pa;
+  char *mem;
+
+  pte = walk(pagetable, PGROUNDDOWN(gpa), 0);
+  if(pte == 0 || (*pte & (PTE_V|PTE_COW)) != (PTE_V|PTE_COW))
+    return -1;
+  if((mem = kalloc()) == 0)
+    return -1;
+  pa = PTE2PA(*pte);
+  memmove(mem, (void*)pa, PGSIZE);
+  *pte = PA2PTE(mem) | ((PTE_FLAGS(*pte) | PTE_W) & ~(PTE_COW|PTE_KSM));
+  hfence_gvma();
+  kfree((void*)pa);
+  return 0;
+}
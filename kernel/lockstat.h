@@ -0,0 +1,10 @@
+// Contention statistics for all locks with one name,
+// as returned by the lockstat system call.
+struct lockstat {
+  char name[16];   // Name of the locks
+  uint nlocks;     // Number of locks with this name
+  uint64 nacquire; // Times acquired
+  uint64 ncontend; // Times an acquire had to wait
+  uint64 nspin;    // Total iterations spent waiting
+  uint64 maxhold;  // Longest time held, in timer units
+};
@@ -6,6 +6,25 @@
 
 volatile static int started = 0;
 
+#if defined(VMM_GUEST) && defined(HCBENCH)
+extern uint64 guest_mhartid(void);
+
+// time the cheapest exit to the vmm and back.
+// only built with make HCBENCH=1.
+static void
+exitbench(void)
+{
+  uint64 t0, t;
+  int i;
+
+  t0 = r_time();
+  for(i = 0; i < 1000; i++)
+    guest_mhartid();
+  t = (r_time() - t0) * (1000000000 / TIMEFREQ) / 1000;
+  printf("hypercall round trip: %d ns\n", (int) t);
+}
+#endif
+
 // start() jumps here in supervisor mode on all CPUs.
 void
 main()
@@ -15,6 +34,9 @@ main()
     printfinit();
     printf("\n");
     printf("xv6 kernel is booting\n");
+#if defined(VMM_GUEST) && defined(HCBENCH)
+    exitbench();
+#endif
     kinit();         // physical page allocator
     kvminit();       // create kernel page table
     kvminithart();   // turn on paging
@@ -26,11 +48,13 @@ main()
     plicinithart();  // ask PLIC for device interrupts
     binit();         // buffer cache
     iinit();         // inode table
+    vmainit();       // demand-paged program text
 #endif
     fileinit();      // file table
 #ifndef VMM_GUEST
     virtio_disk_init(); // emulated hard disk
     vmminit();       // vm monitor
+    vmminithart();   // probe hgatp's VMID bits
 #endif
     userinit();      // first user process
     __sync_synchronize();
@@ -44,6 +68,7 @@ main()
     trapinithart();   // install kernel trap vector
 #ifndef VMM_GUEST
     plicinithart();   // ask PLIC for device interrupts
+    vmminithart();    // probe hgatp's VMID bits
 #endif
   }
 
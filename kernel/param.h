@@ -11,3 +11,10 @@
 #define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
 #define FSSIZE       2000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
+#define NVMA         16    // file-backed memory regions per process
+#define NTEXTPG      128   // program and guest text pages kept for sharing
+#define NICE_MIN    -20    // highest scheduling priority
+#define NICE_MAX     19    // lowest scheduling priority
+#ifndef TICKHZ
+#define TICKHZ       10    // clock ticks per second; make TICKHZ=n to change
+#endif
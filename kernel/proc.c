@@ -4,6 +4,7 @@
 #include "riscv.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "procinfo.h"
 #include "defs.h"
 
 struct cpu cpus[NCPU];
@@ -18,6 +19,15 @@ struct spinlock pid_lock;
 extern void forkret(void);
 
 extern char trampoline[]; // trampoline.S
+extern struct proc *ksmproc; // ksm.c
+
+// Processes in sleep(), hashed by channel, so that wakeup()
+// need only look at the processes sleeping on its channel.
+#define NWAITQ 64
+struct waitq {
+  struct spinlock lock;
+  struct proc *head;
+} waitq[NWAITQ];
 
 // helps ensure that wakeups of wait()ing
 // parents are not lost. helps obey the
@@ -50,10 +60,15 @@ procinit(void)
   
   initlock(&pid_lock, "nextpid");
   initlock(&wait_lock, "wait_lock");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&cpus[i].rqlock, "runq");
+  for(int i = 0; i < NWAITQ; i++)
+    initlock(&waitq[i].lock, "waitq");
   for(p = proc; p < &proc[NPROC]; p++) {
       initlock(&p->lock, "proc");
       p->state = UNUSED;
       p->kstack = KSTACK((int) (p - proc));
+      p->asid = (int) (p - proc) + 1;
   }
 }
 
@@ -124,6 +139,10 @@ found:
   p->pid = allocpid();
   p->state = USED;
 
+  // p->asid may still tag the previous owner's
+  // translations in some CPU's TLB.
+  proc_tlbchanged(p);
+
   // Allocate a trapframe page.
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
     freeproc(p);
@@ -160,6 +179,10 @@ freeproc(struct proc *p)
   if(p->pagetable)
     proc_freepagetable(p->pagetable, p->sz);
   p->pagetable = 0;
+#ifndef VMM_GUEST
+  if(p->stage_pagetable)
+    guestfree(p);
+#endif
   p->sz = 0;
   p->pid = 0;
   p->parent = 0;
@@ -167,6 +190,16 @@ freeproc(struct proc *p)
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
+  p->nice = 0;
+  p->runtime = 0;
+  p->vruntime = 0;
+  p->rq = 0;
+#ifndef VMM_GUEST
+  p->vmid = 0;
+  p->boottime = 0;
+  p->migrated = 0;
+  p->vmstop = 0;
+#endif
   p->state = UNUSED;
 }
 
@@ -204,6 +237,15 @@ proc_pagetable(struct proc *p)
   return pagetable;
 }
 
+// Record that p's page table has changed, so that each CPU
+// flushes p's ASID from its TLB before it next returns to p
+// in user space; see usertrapret().
+void
+proc_tlbchanged(struct proc *p)
+{
+  __sync_fetch_and_add(&p->tlbgen, 1);
+}
+
 // Free a process's page table, and free the
 // physical memory it refers to.
 void
@@ -252,7 +294,7 @@ userinit(void)
   p->cwd = namei("/");
 #endif
 
-  p->state = RUNNABLE;
+  setrunnable(p);
 
   release(&p->lock);
 }
@@ -267,6 +309,10 @@ growproc(int n)
 
   sz = p->sz;
   if(n > 0){
+#ifndef VMM_GUEST
+    if(vmaoverlap(p, PGROUNDUP(sz), sz + n))
+      return -1;
+#endif
     if((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
       return -1;
     }
@@ -274,6 +320,7 @@ growproc(int n)
     sz = uvmdealloc(p->pagetable, sz, sz + n);
   }
   p->sz = sz;
+  proc_tlbchanged(p);
   return 0;
 }
 
@@ -299,6 +346,18 @@ fork(void)
   }
   np->sz = p->sz;
 
+#ifndef VMM_GUEST
+  // Copy file-backed regions, including mmap()ed pages.
+  if(vmadup(np, p) < 0){
+    release(&np->lock);
+    vmaclear(np->pagetable, np->vma, NVMA);
+    acquire(&np->lock);
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+#endif
+
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
 
@@ -317,6 +376,11 @@ fork(void)
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
+  // the child starts with the parent's priority and place in line.
+  np->nice = p->nice;
+  np->vruntime = p->vruntime;
+  np->rq = p->rq;
+
   pid = np->pid;
 
   release(&np->lock);
@@ -326,7 +390,7 @@ fork(void)
   release(&wait_lock);
 
   acquire(&np->lock);
-  np->state = RUNNABLE;
+  setrunnable(np);
   release(&np->lock);
 
   return pid;
@@ -368,6 +432,12 @@ exit(int status)
   }
 
 #ifndef VMM_GUEST
+  if(p->vmid)
+    guestdrop(p);
+
+  // Write back and unmap file-backed regions.
+  vmaclear(p->pagetable, p->vma, NVMA);
+
   begin_op();
   iput(p->cwd);
   end_op();
@@ -443,49 +513,235 @@ wait(uint64 addr)
   }
 }
 
+// Each CPU picks the process on its run queue with the least
+// virtual runtime: CPU time scaled by the inverse of a weight
+// that falls by about 1.25x per nice level, so that runnable
+// processes share a CPU in proportion to their weights.
+static const int niceweight[NICE_MAX - NICE_MIN + 1] = {
+ /* -20 */ 88761, 71755, 56483, 46273, 36291,
+ /* -15 */ 29154, 23254, 18705, 14949, 11916,
+ /* -10 */  9548,  7620,  6100,  4904,  3906,
+ /*  -5 */  3121,  2501,  1991,  1586,  1277,
+ /*   0 */  1024,   820,   655,   526,   423,
+ /*   5 */   335,   272,   215,   172,   137,
+ /*  10 */   110,    87,    70,    56,    45,
+ /*  15 */    36,    29,    23,    18,    15,
+};
+
+// how far behind the CPU's clock a process that has been
+// asleep may start, so that it runs soon but can't hoard
+// credit for the time it slept.
+#define VRUN_SLACK (TIMEFREQ / 10)
+
+// Move p's virtual runtime onto CPU to's clock, keeping its
+// lag behind (or lead over) the CPU it was last queued on.
+static void
+placevrun(struct proc *p, struct cpu *to)
+{
+  long lag = 0;
+
+  if(p->rq)
+    lag = (long) (p->vruntime - p->rq->minvrun);
+  if(lag < -VRUN_SLACK)
+    lag = -VRUN_SLACK;
+  if(lag < 0 && -lag > to->minvrun)
+    p->vruntime = 0;
+  else
+    p->vruntime = to->minvrun + lag;
+  p->rq = to;
+}
+
+// Can CPU c run p? Guests, and ksmd, which changes their
+// page tables, only run on CPU 0.
+static int
+canrun(struct cpu *c, struct proc *p)
+{
+#ifndef VMM_GUEST
+  if((p->vmid || p == ksmproc) && c != &cpus[0])
+    return 0;
+#endif
+  return 1;
+}
+
+// Take the process that CPU c may run with the least virtual
+// runtime off run queue q, or return 0.
+static struct proc*
+dequeue(struct cpu *q, struct cpu *c)
+{
+  struct proc *p, **pp, *prev, *best, **bestpp, *bestprev;
+
+  if(q->nrun == 0)
+    return 0;
+  acquire(&q->rqlock);
+  best = 0;
+  bestpp = 0;
+  bestprev = prev = 0;
+  for(pp = &q->rqhead; (p = *pp) != 0; pp = &p->rqnext){
+    if(canrun(c, p) && (best == 0 || p->vruntime < best->vruntime)){
+      best = p;
+      bestpp = pp;
+      bestprev = prev;
+    }
+    prev = p;
+  }
+  if(best){
+    *bestpp = best->rqnext;
+    if(q->rqtail == best)
+      q->rqtail = bestprev;
+    q->nrun--;
+    if(best->vruntime > q->minvrun)
+      q->minvrun = best->vruntime;
+  }
+  release(&q->rqlock);
+  if(best && q != c)
+    placevrun(best, c);
+  return best;
+}
+
+// Interrupt hart id, to wake it from wfi: timervec turns
+// the machine-mode software interrupt into a supervisor one,
+// which devintr() then ignores.
+void
+kick(int id)
+{
+#ifndef VMM_GUEST
+  *(uint32*)CLINT_MSIP(id) = 1;
+#endif
+}
+
+// Mark p RUNNABLE and put it on a run queue: this CPU's,
+// since it is awake and likely to schedule soon, or CPU 0's
+// for a guest. If some other CPU is idle, kick it so that
+// it can take the process instead.
+// Caller must hold p->lock.
+void
+setrunnable(struct proc *p)
+{
+  struct cpu *c = mycpu(), *q = c;
+  int i;
+
+  if(!canrun(c, p))
+    q = &cpus[0];
+  p->state = RUNNABLE;
+  placevrun(p, q);
+
+  acquire(&q->rqlock);
+  p->rqnext = 0;
+  if(q->rqtail)
+    q->rqtail->rqnext = p;
+  else
+    q->rqhead = p;
+  q->rqtail = p;
+  q->nrun++;
+  release(&q->rqlock);
+
+  for(i = 0; i < NCPU; i++){
+    if(&cpus[i] != c && cpus[i].idle && canrun(&cpus[i], p)){
+      kick(i);
+      break;
+    }
+  }
+}
+
+#ifdef VMM_GUEST
+// A guest idles in a busy loop, since wfi would trap. It
+// keeps a value of its own in an FP register meanwhile and
+// checks it each time around, so that two idle guests on a
+// hart exercise the host's lazy FP switching, fpclaim() in
+// vmm.c, and catch it losing their registers. Nothing else
+// in a guest uses FP.
+static void
+fpidle(void)
+{
+  static uint64 mine;
+  uint64 x;
+
+  if(mine == 0){
+    w_sstatus(r_sstatus() | SSTATUS_FS_INITIAL);
+    mine = r_time() | 1;
+    asm volatile("fmv.d.x fs11, %0" : : "r" (mine));
+  }
+  asm volatile("fmv.x.d %0, fs11" : "=r" (x));
+  if(x != mine)
+    panic("fpidle: FP registers lost");
+}
+#endif
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
-//  - choose a process to run.
+//  - choose the process from this CPU's run queue that
+//    has had the least weighted CPU time, or steal one
+//    from the busiest other CPU's queue.
 //  - swtch to start running that process.
 //  - eventually that process transfers control
 //    via swtch back to the scheduler.
+// With nothing to run, it waits in wfi for an interrupt
+// or a kick() from setrunnable(), or in a guest, spins.
 void
 scheduler(void)
 {
   struct proc *p;
-  struct cpu *c = mycpu();
-#ifndef VMM_GUEST
-  int first = (cpuid() == 0);
-#endif
+  struct cpu *c = mycpu(), *q, *busiest;
+  uint64 start, t;
 
   c->proc = 0;
   for(;;){
     // Avoid deadlock by ensuring that devices can interrupt.
     intr_on();
 
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
+    if((p = dequeue(c, c)) == 0){
+      busiest = 0;
+      for(q = cpus; q < &cpus[NCPU]; q++)
+        if(q != c && q->nrun > 0 && (busiest == 0 || q->nrun > busiest->nrun))
+          busiest = q;
+      if(busiest)
+        p = dequeue(busiest, c);
+    }
+
+    if(p == 0){
 #ifndef VMM_GUEST
-      if(!first && p->vmid) {
-        release(&p->lock);
-        continue;
+      // guests run with hstatus.VTW set, so wfi would trap.
+      // with interrupts off, a kick() that arrives before
+      // the wfi stays pending and ends it at once.
+      intr_off();
+      c->idle = 1;
+      __sync_synchronize();
+      if(c->nrun == 0){
+        timeridle();
+        wfi();
       }
+      c->idle = 0;
+#else
+      fpidle();
 #endif
-      if(p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->context, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
-      }
-      release(&p->lock);
+      continue;
+    }
+
+    acquire(&p->lock);
+    if(p->state == RUNNABLE) {
+      // Switch to chosen process.  It is the process's job
+      // to release its lock and then reacquire it
+      // before jumping back to us.
+      p->state = RUNNING;
+      c->proc = p;
+#ifndef VMM_GUEST
+      if(c->tickless)
+        timerarm();
+#endif
+      start = r_time();
+      swtch(&c->context, &p->context);
+
+      // Process is done running for now.
+      // It should have changed its p->state before coming back.
+      c->proc = 0;
+
+      // Charge it for the time it ran.
+      t = r_time() - start;
+      p->runtime += t;
+      p->vruntime += t * niceweight[0 - NICE_MIN] / niceweight[p->nice - NICE_MIN];
     }
+    release(&p->lock);
   }
 }
 
@@ -522,7 +778,7 @@ yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  setrunnable(p);
   sched();
   release(&p->lock);
 }
@@ -550,13 +806,40 @@ forkret(void)
   usertrapret();
 }
 
+static struct waitq *
+chanq(void *chan)
+{
+  return &waitq[((uint64)chan * 0x9E3779B97F4A7C15UL) >> 58];
+}
+
+static int
+stopping(struct proc *p)
+{
+#ifdef VMM_GUEST
+  return 0;
+#else
+  return vmstopping(p);
+#endif
+}
+
 // Atomically release lock and sleep on chan.
 // Reacquires lock when awakened.
 void
 sleep(void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc();
-  
+  struct waitq *q = chanq(chan);
+
+  // Join chan's wait queue first, so that any wakeup()
+  // that could follow the release of lk below finds p.
+  acquire(&q->lock);
+  p->qnext = q->head;
+  if(q->head)
+    q->head->qpprev = &p->qnext;
+  p->qpprev = &q->head;
+  q->head = p;
+  release(&q->lock);
+
   // Must acquire p->lock in order to
   // change p->state and then call sched.
   // Once we hold p->lock, we can be
@@ -567,17 +850,30 @@ sleep(void *chan, struct spinlock *lk)
   acquire(&p->lock);  //DOC: sleeplock1
   release(lk);
 
-  // Go to sleep.
-  p->chan = chan;
-  p->state = SLEEPING;
+  // Go to sleep, unless p is a guest being stopped in a
+  // hypercall, which vmstopwait() may have missed asleep:
+  // then return at once, as if woken, for it to notice.
+  if(!stopping(p)){
+    p->chan = chan;
+    p->state = SLEEPING;
 
-  sched();
+    sched();
+  }
 
   // Tidy up.
   p->chan = 0;
+  release(&p->lock);
+
+  // Leave the wait queue; wakeup() holds q->lock
+  // while it takes p->lock, so not before now.
+  acquire(&q->lock);
+  if(p->qnext)
+    p->qnext->qpprev = p->qpprev;
+  *p->qpprev = p->qnext;
+  p->qpprev = 0;
+  release(&q->lock);
 
   // Reacquire original lock.
-  release(&p->lock);
   acquire(lk);
 }
 
@@ -586,17 +882,20 @@ sleep(void *chan, struct spinlock *lk)
 void
 wakeup(void *chan)
 {
+  struct waitq *q = chanq(chan);
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
+  acquire(&q->lock);
+  for(p = q->head; p; p = p->qnext) {
     if(p != myproc()){
       acquire(&p->lock);
       if(p->state == SLEEPING && p->chan == chan) {
-        p->state = RUNNABLE;
+        setrunnable(p);
       }
       release(&p->lock);
     }
   }
+  release(&q->lock);
 }
 
 // Kill the process with the given pid.
@@ -613,7 +912,7 @@ kill(int pid)
       p->killed = 1;
       if(p->state == SLEEPING){
         // Wake process from sleep().
-        p->state = RUNNABLE;
+        setrunnable(p);
       }
       release(&p->lock);
       return 0;
@@ -623,6 +922,26 @@ kill(int pid)
   return -1;
 }
 
+// Set the nice value of the process with the given pid.
+int
+setnice(int pid, int nice)
+{
+  struct proc *p;
+
+  if(nice < NICE_MIN || nice > NICE_MAX)
+    return -1;
+  for(p = proc; p < &proc[NPROC]; p++){
+    acquire(&p->lock);
+    if(p->pid == pid && p->state != UNUSED){
+      p->nice = nice;
+      release(&p->lock);
+      return 0;
+    }
+    release(&p->lock);
+  }
+  return -1;
+}
+
 void
 setkilled(struct proc *p)
 {
@@ -675,17 +994,18 @@ either_copyin(void *dst, int user_src, uint64 src, uint64 len)
 // Print a process listing to console.  For debugging.
 // Runs when user types ^P on console.
 // No lock to avoid wedging a stuck machine further.
+static char *states[] = {
+[UNUSED]    "unused",
+[USED]      "used",
+[SLEEPING]  "sleep ",
+[RUNNABLE]  "runble",
+[RUNNING]   "run   ",
+[ZOMBIE]    "zombie"
+};
+
 void
 procdump(void)
 {
-  static char *states[] = {
-  [UNUSED]    "unused",
-  [USED]      "used",
-  [SLEEPING]  "sleep ",
-  [RUNNABLE]  "runble",
-  [RUNNING]   "run   ",
-  [ZOMBIE]    "zombie"
-  };
   struct proc *p;
   char *state;
 
@@ -700,4 +1020,40 @@ procdump(void)
     printf("%d %s %s", p->pid, state, p->name);
     printf("\n");
   }
+#ifndef VMM_GUEST
+  printf("%d free pages, %d merged by ksmd\n", kfreepages(), ksmpages());
+#endif
+}
+
+// Copy a struct procinfo for each of up to n processes
+// to user address addr. Returns the number copied, or -1.
+int
+procinfo(uint64 addr, int n)
+{
+  struct proc *p;
+  struct procinfo pi;
+  int i = 0;
+
+  for(p = proc; p < &proc[NPROC] && i < n; p++){
+    acquire(&p->lock);
+    if(p->state == UNUSED){
+      release(&p->lock);
+      continue;
+    }
+    pi.pid = p->pid;
+    pi.nice = p->nice;
+#ifndef VMM_GUEST
+    pi.vmid = p->vmid;
+#else
+    pi.vmid = 0;
+#endif
+    safestrcpy(pi.state, states[p->state], sizeof(pi.state));
+    safestrcpy(pi.name, p->name, sizeof(pi.name));
+    pi.runtime = p->runtime;
+    release(&p->lock);
+    if(copyout(myproc()->pagetable, addr + i*sizeof(pi), (char *)&pi, sizeof(pi)) < 0)
+      return -1;
+    i++;
+  }
+  return i;
 }
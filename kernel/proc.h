@@ -24,6 +24,19 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+
+  // this CPU's run queue of RUNNABLE processes.
+  struct spinlock rqlock;
+  struct proc *rqhead;        // rqlock must be held when using these.
+  struct proc *rqtail;
+  int nrun;                   // Length of run queue.
+  int idle;                   // In wfi, waiting for work.
+  int tickless;               // Timer stopped or set for sleep() only.
+  uint64 timerdue;            // r_time() of next timer interrupt.
+  uint64 minvrun;             // Virtual runtime of last process picked.
+  struct proc *guest;         // Guest whose hgatp, VS CSRs etc. are loaded, or 0.
+  struct proc *fpowner;       // Guest whose FP registers are loaded, or 0.
+  uint64 vmidmax;             // Largest VMID this hart's hgatp holds.
 };
 
 extern struct cpu cpus[NCPU];
@@ -124,11 +137,42 @@ struct gtrapframe {
   /* 544 */ uint64 guest_hstatus;
   /* 552 */ uint64 guest_scounteren;
   /* 560 */ uint64 guest_sepc;
+  /* 568 */ uint64 guest_memsize;  // for the HC_memsize fast path
+  /* 576 */ uint64 guest_f[32];    // FP registers, when not loaded
+  /* 832 */ uint64 guest_fcsr;
+  /* 840 */ uint64 guest_balloon;  // pages the host wants ballooned
+  // VS-level CSRs, while the guest's are not loaded.
+  /* 848 */ uint64 guest_vsstatus;
+  /* 856 */ uint64 guest_vsie;
+  /* 864 */ uint64 guest_vstvec;
+  /* 872 */ uint64 guest_vsscratch;
+  /* 880 */ uint64 guest_vsepc;
+  /* 888 */ uint64 guest_vscause;
+  /* 896 */ uint64 guest_vstval;
+  /* 904 */ uint64 guest_vsip;
+  /* 912 */ uint64 guest_vsatp;
 };
 
 #endif
 
 
+#ifndef VMM_GUEST
+// A range of user virtual memory whose pages are filled in from
+// an inode by vmafault() the first time each one is touched.
+// exec() describes each program segment with one of these,
+// and mmap() each file mapping.
+struct vma {
+  uint64 addr;        // first virtual address, page-aligned
+  uint64 len;         // bytes of address space; 0 if slot unused
+  uint64 filesz;      // bytes backed by ip, the rest reads as zero
+  uint off;           // file offset that addr corresponds to
+  int perm;           // PTE_R, PTE_W, PTE_X, PTE_U
+  int flags;          // MAP_SHARED or MAP_PRIVATE for mmap()
+  struct file *f;     // mmap()ed file, holds a reference; 0 for exec
+  struct inode *ip;   // backing file; exec holds a reference
+};
+#endif
+
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Per-process state
@@ -141,17 +185,39 @@ struct proc {
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  int nice;                    // Scheduling priority, -20 (high) to 19
+  uint64 runtime;              // CPU time used, in r_time() units
+  uint64 vruntime;             // runtime, scaled down by weight of nice
+  struct cpu *rq;              // CPU whose clock vruntime is relative to
+  uint tlbgen;                 // Bumped when pagetable changes
+  uint tlbseen[NCPU];          // tlbgen when each CPU last flushed asid
 #ifndef VMM_GUEST
   int vmid;                    // Virtual Machine ID
+  int balloon;                 // Guest pages handed back to the host
+  int inhc;                    // Guest is in a hypercall, interrupts on
+  uint64 boottime;             // r_time() at mkguest, until the guest runs
+  int migrated;                // boottime is when vmsend() stopped the original
+  int vmstop;                  // VMSTOP etc.; vmstop_lock must be held
 #endif
 
   // wait_lock must be held when using this:
   struct proc *parent;         // Parent process
 
+  // the lock of the run queue p is on must be held when using this:
+  struct proc *rqnext;         // Next on run queue
+
+  // the lock of chan's wait queue must be held when using these:
+  struct proc *qnext;          // Next on wait queue
+  struct proc **qpprev;        // Link to this on wait queue, or 0
+
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
+  int asid;                    // Address-space ID of pagetable
   uint64 sz;                   // Size of process memory (bytes)
   pagetable_t pagetable;       // User page table
+  uint64 xlva;                 // Last page translated by copyin/out
+  pte_t *xlpte;                // ... its PTE
+  uint xlgen;                  // ... valid while tlbgen matches
 #ifndef VMM_GUEST
   pagetable_t stage_pagetable; // The second-stage page table for guest
   union {
@@ -167,6 +233,7 @@ struct proc {
   char cwd[MAXPATH];           // Current directory for guest
 #else
   struct inode *cwd;           // Current directory
+  struct vma vma[NVMA];        // Demand-paged file-backed memory
 #endif
   char name[16];               // Process name (debugging)
 };
@@ -0,0 +1,9 @@
+// A process, as reported by the procinfo system call.
+struct procinfo {
+  int pid;
+  int nice;         // Scheduling priority, -20 (high) to 19
+  int vmid;         // Virtual Machine ID, or 0 if not a guest
+  char state[8];    // "sleep", "run", ...
+  char name[16];    // Process name
+  uint64 runtime;   // CPU time used, in TIMEFREQ units per second
+};
@@ -43,6 +43,11 @@ w_mepc(uint64 x)
 
 // Supervisor Status Register, sstatus
 
+#define SSTATUS_FS (3L << 13)  // FP unit state:
+#define SSTATUS_FS_OFF (0L << 13)     //   FP instructions trap
+#define SSTATUS_FS_INITIAL (1L << 13) //   usable, registers at reset values
+#define SSTATUS_FS_CLEAN (2L << 13)   //   usable, registers unchanged since saved
+#define SSTATUS_FS_DIRTY (3L << 13)   //   usable, registers changed
 #define SSTATUS_SPP (1L << 8)  // Previous mode, 1=Supervisor, 0=User
 #define SSTATUS_SPIE (1L << 5) // Supervisor Previous Interrupt Enable
 #define SSTATUS_UPIE (1L << 4) // User Previous Interrupt Enable
@@ -200,7 +205,9 @@ w_pmpaddr0(uint64 x)
 // use riscv's sv39 page table scheme.
 #define SATP_SV39 (8L << 60)
 
-#define MAKE_SATP(pagetable) (SATP_SV39 | (((uint64)pagetable) >> 12))
+#define MAKE_SATP(pagetable, asid) (SATP_SV39 | \
+  (((uint64)(asid) & SATP_ASID_MASK) << SATP_ASID_SHIFT) | \
+  (((uint64)pagetable) >> 12))
 
 // supervisor address translation and protection;
 // holds the address of the page table.
@@ -257,6 +264,21 @@ r_mcounteren()
   return x;
 }
 
+// Supervisor-mode Counter-Enable
+static inline void 
+w_scounteren(uint64 x)
+{
+  asm volatile("csrw scounteren, %0" : : "r" (x));
+}
+
+static inline uint64
+r_scounteren()
+{
+  uint64 x;
+  asm volatile("csrr %0, scounteren" : "=r" (x) );
+  return x;
+}
+
 // machine-mode cycle counter
 static inline uint64
 r_time()
@@ -288,6 +310,13 @@ intr_get()
   return (x & SSTATUS_SIE) != 0;
 }
 
+// wait (stall the hart) until an interrupt is pending.
+static inline void
+wfi()
+{
+  asm volatile("wfi");
+}
+
 static inline uint64
 r_sp()
 {
@@ -328,6 +357,13 @@ sfence_vma()
   asm volatile("sfence.vma zero, zero");
 }
 
+// flush the TLB entries of one address space.
+static inline void
+sfence_vma_asid(uint64 asid)
+{
+  asm volatile("sfence.vma zero, %0" : : "r" (asid));
+}
+
 typedef uint64 pte_t;
 typedef uint64 *pagetable_t; // 512 PTEs
 
@@ -339,14 +375,17 @@ typedef uint64 *pagetable_t; // 512 PTEs
 #define STR_CSR_HCOUNTEREN "0x606"
 #define STR_CSR_HVIP    "0x645"
 #define STR_CSR_HGATP   "0x680"
+#define STR_CSR_HTVAL   "0x643"
 
 #define STR_CSR_VSSTATUS "0x200"
 #define STR_CSR_VSIE     "0x204"
 #define STR_CSR_VSTVEC   "0x205"
+#define STR_CSR_VSSCRATCH "0x240"
 #define STR_CSR_VSEPC    "0x241"
 #define STR_CSR_VSCAUSE  "0x242"
 #define STR_CSR_VSTVAL   "0x243"
 #define STR_CSR_VSIP     "0x244"
+#define STR_CSR_VSATP    "0x280"
 
 #define HSTATUS_VTSR  (1L << 22)
 #define HSTATUS_VTW   (1L << 21)
@@ -395,6 +434,23 @@ w_hgatp(uint64 x)
   asm volatile("csrw " STR_CSR_HGATP ", %0" :: "r"(x) );
 }
 
+// guest-physical address of a guest-page fault, shifted right by 2.
+static inline uint64
+r_htval()
+{
+  uint64 x;
+  asm volatile("csrr %0, " STR_CSR_HTVAL : "=r" (x) );
+  return x;
+}
+
+// flush guest-physical translations for all VMIDs.
+static inline void
+hfence_gvma()
+{
+  // hfence.gvma zero, zero
+  asm volatile(".word 0x62000073" : : : "memory");
+}
+
 static inline uint64
 r_hedeleg()
 {
@@ -549,10 +605,44 @@ w_vsip(uint64 x)
   asm volatile("csrw " STR_CSR_VSIP ", %0" :: "r"(x) );
 }
 
+static inline uint64
+r_vsscratch()
+{
+  uint64 x;
+  asm volatile("csrr %0, " STR_CSR_VSSCRATCH : "=r" (x) );
+  return x;
+}
+
+static inline void
+w_vsscratch(uint64 x)
+{
+  asm volatile("csrw " STR_CSR_VSSCRATCH ", %0" :: "r"(x) );
+}
+
+static inline uint64
+r_vsatp()
+{
+  uint64 x;
+  asm volatile("csrr %0, " STR_CSR_VSATP : "=r" (x) );
+  return x;
+}
+
+static inline void
+w_vsatp(uint64 x)
+{
+  asm volatile("csrw " STR_CSR_VSATP ", %0" :: "r"(x) );
+}
+
 #endif // VMM_GUEST
 
 #endif // __ASSEMBLER__
 
+// satp's address-space identifier field, bits 44..59, which
+// tags TLB entries so that switching page tables needn't
+// flush them.
+#define SATP_ASID_SHIFT 44
+#define SATP_ASID_MASK  0xFFFFL
+
 #define PGSIZE 4096 // bytes per page
 #define PGSHIFT 12  // bits of offset within a page
 
@@ -564,6 +654,11 @@ w_vsip(uint64 x)
 #define PTE_W (1L << 2)
 #define PTE_X (1L << 3)
 #define PTE_U (1L << 4) // user can access
+#define PTE_A (1L << 6) // accessed
+#define PTE_D (1L << 7) // dirty
+#define PTE_COW (1L << 8) // RSW: guest may write once it has its own copy
+#define PTE_KSM (1L << 9) // RSW: maps a page merged by ksm.c
+#define PTE_LAZY (1L << 8) // with PTE_V clear: demand-paged, not read in yet
 
 // shift a physical address to the right place for a PTE.
 #define PA2PTE(pa) ((((uint64)pa) >> 12) << 10)
@@ -572,6 +667,9 @@ w_vsip(uint64 x)
 
 #define PTE_FLAGS(pte) ((pte) & 0x3FF)
 
+// does a valid PTE map memory, rather than point to the next level?
+#define PTE_LEAF(pte) (((pte) & (PTE_R|PTE_W|PTE_X)) != 0)
+
 // extract the three 9-bit page table indices from a virtual address.
 #define PXMASK          0x1FF // 9 bits
 #define PXSHIFT(level)  (PGSHIFT+(9*(level)))
@@ -6,14 +6,43 @@
 #include "spinlock.h"
 #include "riscv.h"
 #include "proc.h"
+#include "lockstat.h"
 #include "defs.h"
 
+// All initialized locks, for lockstats().
+static struct spinlock locklist = { .name = "locklist" };
+static struct spinlock *locks;
+
 void
 initlock(struct spinlock *lk, char *name)
 {
   lk->name = name;
-  lk->locked = 0;
+  lk->ticket = 0;
+  lk->serving = 0;
   lk->cpu = 0;
+  lk->nacquire = 0;
+  lk->ncontend = 0;
+  lk->nspin = 0;
+  lk->maxhold = 0;
+
+  acquire(&locklist);
+  lk->lnext = locks;
+  if(locks)
+    locks->lpprev = &lk->lnext;
+  lk->lpprev = &locks;
+  locks = lk;
+  release(&locklist);
+}
+
+// Forget a lock that is about to be freed.
+void
+freelock(struct spinlock *lk)
+{
+  acquire(&locklist);
+  if(lk->lnext)
+    lk->lnext->lpprev = lk->lpprev;
+  *lk->lpprev = lk->lnext;
+  release(&locklist);
 }
 
 // Acquire the lock.
@@ -21,15 +50,18 @@ initlock(struct spinlock *lk, char *name)
 void
 acquire(struct spinlock *lk)
 {
+  uint t;
+  uint64 spins;
+
   push_off(); // disable interrupts to avoid deadlock.
   if(holding(lk))
     panic("acquire");
 
-  // On RISC-V, sync_lock_test_and_set turns into an atomic swap:
-  //   a5 = 1
-  //   s1 = &lk->locked
-  //   amoswap.w.aq a5, a5, (s1)
-  while(__sync_lock_test_and_set(&lk->locked, 1) != 0)
+  // Take a ticket, and wait for it to be served.
+  // On RISC-V, sync_fetch_and_add turns into an atomic add:
+  //   amoadd.w a5, a5, (s1)
+  t = __sync_fetch_and_add(&lk->ticket, 1);
+  for(spins = 0; __atomic_load_n(&lk->serving, __ATOMIC_RELAXED) != t; spins++)
     ;
 
   // Tell the C compiler and the processor to not move loads or stores
@@ -40,15 +72,28 @@ acquire(struct spinlock *lk)
 
   // Record info about lock acquisition for holding() and debugging.
   lk->cpu = mycpu();
+
+  lk->nacquire++;
+  if(spins){
+    lk->ncontend++;
+    lk->nspin += spins;
+  }
+  lk->tacquire = r_time();
 }
 
 // Release the lock.
 void
 release(struct spinlock *lk)
 {
+  uint64 held;
+
   if(!holding(lk))
     panic("release");
 
+  held = r_time() - lk->tacquire;
+  if(held > lk->maxhold)
+    lk->maxhold = held;
+
   lk->cpu = 0;
 
   // Tell the C compiler and the CPU to not move loads or stores
@@ -59,14 +104,12 @@ release(struct spinlock *lk)
   // On RISC-V, this emits a fence instruction.
   __sync_synchronize();
 
-  // Release the lock, equivalent to lk->locked = 0.
-  // This code doesn't use a C assignment, since the C standard
-  // implies that an assignment might be implemented with
-  // multiple store instructions.
-  // On RISC-V, sync_lock_release turns into an atomic swap:
-  //   s1 = &lk->locked
-  //   amoswap.w zero, zero, (s1)
-  __sync_lock_release(&lk->locked);
+  // Serve the next ticket, equivalent to lk->serving++.
+  // Only the holder writes serving, but this code doesn't use
+  // a C assignment, since the C standard implies that an
+  // assignment might be implemented with multiple store
+  // instructions.
+  __atomic_store_n(&lk->serving, lk->serving + 1, __ATOMIC_RELAXED);
 
   pop_off();
 }
@@ -77,7 +120,7 @@ int
 holding(struct spinlock *lk)
 {
   int r;
-  r = (lk->locked && lk->cpu == mycpu());
+  r = (lk->ticket != lk->serving && lk->cpu == mycpu());
   return r;
 }
 
@@ -108,3 +151,57 @@ pop_off(void)
   if(c->noff == 0 && c->intena)
     intr_on();
 }
+
+// Copy statistics for up to n lock names to user address
+// addr, hottest (most time spent waiting) first. Locks that
+// share a name, such as all the "proc" locks, are added
+// together. Returns the number of entries copied, or -1.
+int
+lockstats(uint64 addr, int n)
+{
+  struct lockstat *st, *s, t;
+  struct spinlock *lk;
+  int i, j, nst, max;
+
+  if((st = (struct lockstat *) kalloc()) == 0)
+    return -1;
+  max = PGSIZE / sizeof(*st);
+  nst = 0;
+
+  acquire(&locklist);
+  for(lk = locks; lk; lk = lk->lnext){
+    for(s = st; s < st + nst; s++)
+      if(strncmp(s->name, lk->name, sizeof(s->name) - 1) == 0)
+        break;
+    if(s == st + nst){
+      if(nst == max)
+        continue;
+      nst++;
+      memset(s, 0, sizeof(*s));
+      safestrcpy(s->name, lk->name, sizeof(s->name));
+    }
+    s->nlocks++;
+    s->nacquire += lk->nacquire;
+    s->ncontend += lk->ncontend;
+    s->nspin += lk->nspin;
+    if(lk->maxhold > s->maxhold)
+      s->maxhold = lk->maxhold;
+  }
+  release(&locklist);
+
+  for(i = 1; i < nst; i++){
+    t = st[i];
+    for(j = i; j > 0 && st[j-1].nspin < t.nspin; j--)
+      st[j] = st[j-1];
+    st[j] = t;
+  }
+
+  if(n > nst)
+    n = nst;
+  if(n < 0)
+    n = 0;
+  if(copyout(myproc()->pagetable, addr, (char *) st, n * sizeof(*st)) < 0)
+    n = -1;
+  kfree(st);
+  return n;
+}
@@ -1,9 +1,20 @@
 // Mutual exclusion lock.
+// A ticket lock: acquire() takes the next ticket and waits until
+// it is being served, so waiting CPUs get the lock in FIFO order.
 struct spinlock {
-  uint locked;       // Is the lock held?
+  uint ticket;       // Next ticket to hand out.
+  uint serving;      // Ticket of the holder, or of the next holder.
 
   // For debugging:
   char *name;        // Name of lock.
   struct cpu *cpu;   // The cpu holding the lock.
-};
 
+  // Statistics for lockstat(), updated by the holder:
+  uint64 nacquire;   // Times acquired.
+  uint64 ncontend;   // Times acquire() had to wait.
+  uint64 nspin;      // Total iterations spent waiting.
+  uint64 tacquire;   // r_time() when last acquired.
+  uint64 maxhold;    // Longest time held, in r_time() units.
+  struct spinlock *lnext;    // List of all locks.
+  struct spinlock **lpprev;
+};
@@ -1,13 +1,40 @@
 #include "types.h"
 
+// memset, memcmp and memmove work a word (8 bytes) at a time,
+// four words per loop, once both pointers are word-aligned;
+// the unaligned head and the tail go a byte at a time. Pointers
+// that can never be aligned together take the byte loop.
+
+#define WSIZE   sizeof(uint64)
+#define WMASK   (WSIZE - 1)
+#define WALIGNED(a, b) ((((uint64)(a) ^ (uint64)(b)) & WMASK) == 0)
+
 void*
 memset(void *dst, int c, uint n)
 {
-  char *cdst = (char *) dst;
-  int i;
-  for(i = 0; i < n; i++){
-    cdst[i] = c;
+  uchar *d = (uchar *) dst;
+  uint64 w, *wd;
+
+  if(n >= 4*WSIZE){
+    for(; (uint64)d & WMASK; n--)
+      *d++ = c;
+    w = (uchar) c;
+    w |= w << 8;
+    w |= w << 16;
+    w |= w << 32;
+    wd = (uint64 *) d;
+    for(; n >= 4*WSIZE; n -= 4*WSIZE, wd += 4){
+      wd[0] = w;
+      wd[1] = w;
+      wd[2] = w;
+      wd[3] = w;
+    }
+    for(; n >= WSIZE; n -= WSIZE)
+      *wd++ = w;
+    d = (uchar *) wd;
   }
+  while(n-- > 0)
+    *d++ = c;
   return dst;
 }
 
@@ -18,6 +45,15 @@ memcmp(const void *v1, const void *v2, uint n)
 
   s1 = v1;
   s2 = v2;
+  if(n >= WSIZE && WALIGNED(s1, s2)){
+    for(; n > 0 && ((uint64)s1 & WMASK); n--, s1++, s2++)
+      if(*s1 != *s2)
+        return *s1 - *s2;
+    // skip equal words; the byte loop finds the difference.
+    for(; n >= WSIZE; n -= WSIZE, s1 += WSIZE, s2 += WSIZE)
+      if(*(const uint64 *)s1 != *(const uint64 *)s2)
+        break;
+  }
   while(n-- > 0){
     if(*s1 != *s2)
       return *s1 - *s2;
@@ -32,6 +68,8 @@ memmove(void *dst, const void *src, uint n)
 {
   const char *s;
   char *d;
+  const uint64 *ws;
+  uint64 *wd;
 
   if(n == 0)
     return dst;
@@ -41,11 +79,46 @@ memmove(void *dst, const void *src, uint n)
   if(s < d && s + n > d){
     s += n;
     d += n;
+    if(n >= 4*WSIZE && WALIGNED(s, d)){
+      for(; (uint64)d & WMASK; n--)
+        *--d = *--s;
+      ws = (const uint64 *) s;
+      wd = (uint64 *) d;
+      for(; n >= 4*WSIZE; n -= 4*WSIZE){
+        ws -= 4;
+        wd -= 4;
+        wd[3] = ws[3];
+        wd[2] = ws[2];
+        wd[1] = ws[1];
+        wd[0] = ws[0];
+      }
+      for(; n >= WSIZE; n -= WSIZE)
+        *--wd = *--ws;
+      s = (const char *) ws;
+      d = (char *) wd;
+    }
     while(n-- > 0)
       *--d = *--s;
-  } else
+  } else {
+    if(n >= 4*WSIZE && WALIGNED(s, d)){
+      for(; (uint64)d & WMASK; n--)
+        *d++ = *s++;
+      ws = (const uint64 *) s;
+      wd = (uint64 *) d;
+      for(; n >= 4*WSIZE; n -= 4*WSIZE, ws += 4, wd += 4){
+        wd[0] = ws[0];
+        wd[1] = ws[1];
+        wd[2] = ws[2];
+        wd[3] = ws[3];
+      }
+      for(; n >= WSIZE; n -= WSIZE)
+        *wd++ = *ws++;
+      s = (const char *) ws;
+      d = (char *) wd;
+    }
     while(n-- > 0)
       *d++ = *s++;
+  }
 
   return dst;
 }
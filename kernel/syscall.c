@@ -101,8 +101,20 @@ extern uint64 sys_unlink(void);
 extern uint64 sys_link(void);
 extern uint64 sys_mkdir(void);
 extern uint64 sys_close(void);
+extern uint64 sys_lockstat(void);
+extern uint64 sys_setnice(void);
+extern uint64 sys_procinfo(void);
+extern uint64 sys_clock_gettime(void);
+extern uint64 sys_nanosleep(void);
 #ifndef VMM_GUEST
 extern uint64 sys_mkguest(void);
+extern uint64 sys_mmap(void);
+extern uint64 sys_munmap(void);
+extern uint64 sys_balloon(void);
+extern uint64 sys_vmsave(void);
+extern uint64 sys_vmrestore(void);
+extern uint64 sys_vmdirty(void);
+extern uint64 sys_vmsend(void);
 #endif
 
 // An array mapping syscall numbers from syscall.h
@@ -129,8 +141,20 @@ static uint64 (*syscalls[])(void) = {
 [SYS_link]    sys_link,
 [SYS_mkdir]   sys_mkdir,
 [SYS_close]   sys_close,
+[SYS_lockstat] sys_lockstat,
+[SYS_setnice] sys_setnice,
+[SYS_procinfo] sys_procinfo,
+[SYS_clock_gettime] sys_clock_gettime,
+[SYS_nanosleep] sys_nanosleep,
 #ifndef VMM_GUEST
 [SYS_mkguest] sys_mkguest,
+[SYS_mmap]    sys_mmap,
+[SYS_munmap]  sys_munmap,
+[SYS_balloon] sys_balloon,
+[SYS_vmsave]  sys_vmsave,
+[SYS_vmrestore] sys_vmrestore,
+[SYS_vmdirty] sys_vmdirty,
+[SYS_vmsend]  sys_vmsend,
 #endif
 };
 
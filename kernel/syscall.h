@@ -21,3 +21,15 @@
 #define SYS_mkdir  20
 #define SYS_close  21
 #define SYS_mkguest 22
+#define SYS_mmap   23
+#define SYS_munmap 24
+#define SYS_lockstat 25
+#define SYS_setnice 26
+#define SYS_procinfo 27
+#define SYS_clock_gettime 28
+#define SYS_nanosleep 29
+#define SYS_balloon 30
+#define SYS_vmsave 31
+#define SYS_vmrestore 32
+#define SYS_vmdirty 33
+#define SYS_vmsend 34
@@ -5,6 +5,7 @@
 #include "memlayout.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "time.h"
 
 uint64
 sys_exit(void)
@@ -56,12 +57,66 @@ sys_sleep(void)
 
   argint(0, &n);
   acquire(&tickslock);
-  ticks0 = ticks;
-  while(ticks - ticks0 < n){
+  ticks0 = tickupdate();
+  while(tickupdate() - ticks0 < n){
     if(killed(myproc())){
       release(&tickslock);
       return -1;
     }
+    clockat((uint64)(ticks0 + n) * TICKINTERVAL);
+    sleep(&ticks, &tickslock);
+  }
+  release(&tickslock);
+  return 0;
+}
+
+// nanoseconds in one r_time() cycle.
+#define NSPERCYCLE (1000000000 / TIMEFREQ)
+
+// store the time since boot, to the resolution
+// of the time CSR, in a struct timespec.
+uint64
+sys_clock_gettime(void)
+{
+  int clock;
+  uint64 addr, t;
+  struct timespec ts;
+
+  argint(0, &clock);
+  argaddr(1, &addr);
+  if(clock != CLOCK_MONOTONIC)
+    return -1;
+  t = r_time();
+  ts.tv_sec = t / TIMEFREQ;
+  ts.tv_nsec = (t % TIMEFREQ) * NSPERCYCLE;
+  if(copyout(myproc()->pagetable, addr, (char *)&ts, sizeof(ts)) < 0)
+    return -1;
+  return 0;
+}
+
+// sleep for the time in a struct timespec. unlike
+// sys_sleep(), wakes as soon as that time has passed
+// rather than at the next clock tick.
+uint64
+sys_nanosleep(void)
+{
+  uint64 addr, deadline;
+  struct timespec ts;
+
+  argaddr(0, &addr);
+  if(copyin(myproc()->pagetable, (char *)&ts, addr, sizeof(ts)) < 0)
+    return -1;
+  if(ts.tv_nsec >= 1000000000 || ts.tv_sec >= (1L << 32))
+    return -1;
+  deadline = r_time() + ts.tv_sec * TIMEFREQ + ts.tv_nsec / NSPERCYCLE;
+
+  acquire(&tickslock);
+  while(r_time() < deadline){
+    if(killed(myproc())){
+      release(&tickslock);
+      return -1;
+    }
+    clockat(deadline);
     sleep(&ticks, &tickslock);
   }
   release(&tickslock);
@@ -85,7 +140,43 @@ sys_uptime(void)
   uint xticks;
 
   acquire(&tickslock);
-  xticks = ticks;
+  xticks = tickupdate();
   release(&tickslock);
   return xticks;
 }
+
+uint64
+sys_setnice(void)
+{
+  int pid, nice;
+
+  argint(0, &pid);
+  argint(1, &nice);
+  return setnice(pid, nice);
+}
+
+// copy a struct procinfo for each process
+// to user memory.
+uint64
+sys_procinfo(void)
+{
+  uint64 addr;
+  int n;
+
+  argaddr(0, &addr);
+  argint(1, &n);
+  return procinfo(addr, n);
+}
+
+// copy contention statistics for the n
+// hottest kinds of lock to user memory.
+uint64
+sys_lockstat(void)
+{
+  uint64 addr;
+  int n;
+
+  argaddr(0, &addr);
+  argint(1, &n);
+  return lockstats(addr, n);
+}
@@ -0,0 +1,7 @@
+// Clocks for the clock_gettime system call.
+#define CLOCK_MONOTONIC 1  // time since boot
+
+struct timespec {
+  uint64 tv_sec;   // seconds
+  uint64 tv_nsec;  // and nanoseconds, less than 1000000000
+};
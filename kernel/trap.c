@@ -8,6 +8,11 @@
 
 struct spinlock tickslock;
 uint ticks;
+uint64 sleepdeadline = -1;  // earliest r_time() a sleeper awaits
+
+#ifndef VMM_GUEST
+static void timerset(uint64);
+#endif
 
 extern char trampoline[], uservec[], userret[];
 
@@ -27,6 +32,10 @@ void
 trapinithart(void)
 {
   w_stvec((uint64)kernelvec);
+
+  // let user code read the cycle and time counters
+  // with rdcycle and rdtime, without a system call.
+  w_scounteren(r_scounteren() | 3);
 }
 
 //
@@ -65,6 +74,11 @@ usertrap(void)
     intr_on();
 
     syscall();
+#ifndef VMM_GUEST
+  } else if((r_scause() == 12 || r_scause() == 13 || r_scause() == 15) &&
+            vmafault(p->pagetable, r_stval(), r_scause() == 15) != 0){
+    // page of a demand-paged file region, now mapped.
+#endif
   } else if((which_dev = devintr()) != 0){
     // ok
   } else {
@@ -119,14 +133,22 @@ usertrapret(void)
   // set S Exception Program Counter to the saved user pc.
   w_sepc(p->trapframe->epc);
 
-  // tell trampoline.S the user page table to switch to.
-  uint64 satp = MAKE_SATP(p->pagetable);
+  // tell trampoline.S the user page table to switch to, tagged
+  // with p's ASID, and whether this CPU's TLB may still hold
+  // translations for that ASID that are no longer right.
+  // without ASIDs, userret flushes the whole TLB every time.
+  uint64 satp = MAKE_SATP(p->pagetable, useasid ? p->asid : 0);
+  uint64 flush = 0;
+  if(p->tlbseen[cpuid()] != p->tlbgen){
+    p->tlbseen[cpuid()] = p->tlbgen;
+    flush = 1;
+  }
 
   // jump to userret in trampoline.S at the top of memory, which 
   // switches to the user page table, restores user registers,
   // and switches to user mode with sret.
   uint64 trampoline_userret = TRAMPOLINE + (userret - trampoline);
-  ((void (*)(uint64))trampoline_userret)(satp);
+  ((void (*)(uint64, uint64))trampoline_userret)(satp, flush);
 }
 
 // interrupts and exceptions from kernel code go here via kernelvec,
@@ -164,15 +186,97 @@ kerneltrap()
   w_sstatus(sstatus);
 }
 
+// Bring ticks up to date, and return it.
+// On the host, ticks are counted from the time CSR rather than
+// from interrupts, since hart 0 may idle through many.
+// tickslock must be held.
+uint
+tickupdate(void)
+{
+#ifndef VMM_GUEST
+  ticks = r_time() / TICKINTERVAL;
+#endif
+  return ticks;
+}
+
+// Ask for a clock interrupt, and a wakeup(&ticks), at time
+// t in r_time() units, to end a sys_sleep() or nanosleep().
+// tickslock must be held.
+void
+clockat(uint64 t)
+{
+  if(t < sleepdeadline){
+    sleepdeadline = t;
+#ifndef VMM_GUEST
+    // hart 0 may be in wfi with no timer, or have its
+    // timer set for later; see timeridle() and devintr().
+    __sync_synchronize();
+    if(cpuid() == 0){
+      if(t < mycpu()->timerdue)
+        timerset(t);
+    } else if(cpus[0].tickless || t < cpus[0].timerdue){
+      kick(0);
+    }
+#endif
+  }
+}
+
 void
 clockintr()
 {
   acquire(&tickslock);
+#ifndef VMM_GUEST
+  tickupdate();
+  if(r_time() >= sleepdeadline){
+    sleepdeadline = -1;
+    wakeup(&ticks);
+  }
+#else
   ticks++;
   wakeup(&ticks);
+#endif
   release(&tickslock);
 }
 
+#ifndef VMM_GUEST
+// Program this hart's next timer interrupt for time t.
+static void
+timerset(uint64 t)
+{
+  mycpu()->timerdue = t;
+  *(uint64*)CLINT_MTIMECMP(cpuid()) = t;
+}
+
+// Arm this hart's timer for the end of the current
+// scheduling quantum, or, on hart 0, for the next
+// sys_sleep() deadline if that comes sooner.
+void
+timerarm(void)
+{
+  uint64 t = r_time() + TICKINTERVAL;
+
+  if(cpuid() == 0 && sleepdeadline < t)
+    t = sleepdeadline;
+  timerset(t);
+  mycpu()->tickless = 0;
+}
+
+// Stop this idle hart's periodic timer. Hart 0 keeps
+// time for sys_sleep(), so it wakes for the next
+// deadline, if there is one.
+void
+timeridle(void)
+{
+  uint64 t = -1;
+
+  mycpu()->tickless = 1;
+  __sync_synchronize();
+  if(cpuid() == 0)
+    t = sleepdeadline;
+  timerset(t);
+}
+#endif
+
 // check if it's an external interrupt or software interrupt,
 // and handle it.
 // returns 2 if timer interrupt,
@@ -209,16 +313,33 @@ devintr()
     return 1;
   } else if(scause == 0x8000000000000001L){
     // software interrupt from a machine-mode timer interrupt,
-    // forwarded by timervec in kernelvec.S.
+    // or from another hart's kick(), forwarded by timervec
+    // in kernelvec.S.
 
-    if(cpuid() == 0){
-      clockintr();
-    }
-    
     // acknowledge the software interrupt by clearing
     // the SSIP bit in sip.
     w_sip(r_sip() & ~2);
 
+#ifndef VMM_GUEST
+    if(r_time() < mycpu()->timerdue){
+      // a kick; the timer hasn't fired. hart 0 is kicked
+      // when a sleeper needs an earlier deadline.
+      if(cpuid() == 0 && sleepdeadline < mycpu()->timerdue)
+        timerset(sleepdeadline);
+      return 1;
+    }
+#endif
+
+    if(cpuid() == 0){
+      clockintr();
+#ifdef VMM_GUEST
+      balloonpoll();
+#endif
+    }
+#ifndef VMM_GUEST
+    timerarm();
+#endif
+
     return 2;
   } else {
     return 0;
@@ -3,6 +3,8 @@
 #include "memlayout.h"
 #include "elf.h"
 #include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
 #include "defs.h"
 #include "fs.h"
 
@@ -15,6 +17,10 @@ extern char etext[];  // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[]; // trampoline.S
 
+// does the MMU implement enough ASID bits to give every
+// process its own? the kernel itself always uses ASID 0.
+int useasid;
+
 // Make a direct-map page table for the kernel.
 pagetable_t
 kvmmake(void)
@@ -27,6 +33,11 @@ kvmmake(void)
   // uart registers
   kvmmap(kpgtbl, UART0, UART0, PGSIZE, PTE_R | PTE_W);
 
+#ifndef VMM_GUEST
+  // CLINT, to program timers and to kick idle harts
+  kvmmap(kpgtbl, CLINT, CLINT, 0x10000, PTE_R | PTE_W);
+#endif
+
   // virtio mmio disk interface
   kvmmap(kpgtbl, VIRTIO0, VIRTIO0, PGSIZE, PTE_R | PTE_W);
 
@@ -37,6 +48,8 @@ kvmmake(void)
   kvmmap(kpgtbl, KERNBASE, KERNBASE, (uint64)etext-KERNBASE, PTE_R | PTE_X);
 
   // map kernel data and the physical RAM we'll make use of.
+  // kvmmap() uses 2 MiB pages for all of it past the first
+  // 2 MiB boundary after etext.
   kvmmap(kpgtbl, (uint64)etext, (uint64)etext, PHYSTOP-(uint64)etext, PTE_R | PTE_W);
 
   // map the trampoline for trap entry/exit to
@@ -61,10 +74,17 @@ kvminit(void)
 void
 kvminithart()
 {
+  uint64 asidmax;
+
   // wait for any previous writes to the page table memory to finish.
   sfence_vma();
 
-  w_satp(MAKE_SATP(kernel_pagetable));
+  // the ASID field reads back with only the implemented bits set.
+  w_satp(MAKE_SATP(kernel_pagetable, SATP_ASID_MASK));
+  asidmax = (r_satp() >> SATP_ASID_SHIFT) & SATP_ASID_MASK;
+  useasid = (asidmax >= NPROC);
+
+  w_satp(MAKE_SATP(kernel_pagetable, 0));
 
   // flush stale entries from the TLB.
   sfence_vma();
@@ -82,15 +102,29 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
+//
+// A valid PTE with any of R, W, X set at level 2 or 1 is a
+// leaf for a 1 GiB or 2 MiB superpage; the kernel's direct
+// map uses them. If va falls in a superpage, return its PTE.
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
+{
+  return walklevel(pagetable, va, 0, alloc);
+}
+
+// Like walk(), but return the PTE for va at the given level
+// of the tree (0, 1 or 2), for mapping a superpage there.
+pte_t *
+walklevel(pagetable_t pagetable, uint64 va, int leaf, int alloc)
 {
   if(va >= MAXVA)
     panic("walk");
 
-  for(int level = 2; level > 0; level--) {
+  for(int level = 2; level > leaf; level--) {
     pte_t *pte = &pagetable[PX(level, va)];
     if(*pte & PTE_V) {
+      if(PTE_LEAF(*pte))
+        return pte;
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
       if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
@@ -99,40 +133,73 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
-  return &pagetable[PX(0, va)];
+  return &pagetable[PX(leaf, va)];
 }
 
-// Look up a virtual address, return the physical address,
-// or 0 if not mapped.
+// Look up a virtual address, return the physical address
+// of the 4096-byte page holding it, or 0 if not mapped.
 // Can only be used to look up user pages.
 uint64
 walkaddr(pagetable_t pagetable, uint64 va)
 {
   pte_t *pte;
   uint64 pa;
+  int level;
 
   if(va >= MAXVA)
     return 0;
 
-  pte = walk(pagetable, va, 0);
-  if(pte == 0)
-    return 0;
-  if((*pte & PTE_V) == 0)
-    return 0;
+  for(level = 2; level >= 0; level--){
+    pte = &pagetable[PX(level, va)];
+    if((*pte & PTE_V) == 0)
+      return 0;
+    if(PTE_LEAF(*pte))
+      break;
+    if(level == 0)
+      return 0;
+    pagetable = (pagetable_t)PTE2PA(*pte);
+  }
   if((*pte & PTE_U) == 0)
     return 0;
   pa = PTE2PA(*pte);
+  // the page within a superpage.
+  pa += PGROUNDDOWN(va) & ((1L << PXSHIFT(level)) - 1);
   return pa;
 }
 
 // add a mapping to the kernel page table.
+// uses the largest pages that va, pa and sz allow,
+// so that the direct map of RAM takes few PTEs and
+// few TLB entries.
 // only used when booting.
 // does not flush TLB or enable paging.
 void
 kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
 {
-  if(mappages(kpgtbl, va, sz, pa, perm) != 0)
-    panic("kvmmap");
+  uint64 a, end, size;
+  pte_t *pte;
+  int level;
+
+  if(sz == 0)
+    panic("kvmmap: size");
+
+  a = PGROUNDDOWN(va);
+  end = PGROUNDDOWN(va + sz - 1) + PGSIZE;
+  while(a < end){
+    for(level = 2; level > 0; level--){
+      size = 1L << PXSHIFT(level);
+      if(a % size == 0 && pa % size == 0 && end - a >= size)
+        break;
+    }
+    size = 1L << PXSHIFT(level);
+    if((pte = walklevel(kpgtbl, a, level, 1)) == 0)
+      panic("kvmmap");
+    if(*pte & PTE_V)
+      panic("kvmmap: remap");
+    *pte = PA2PTE(pa) | perm | PTE_V;
+    a += size;
+    pa += size;
+  }
 }
 
 // Create PTEs for virtual addresses starting at va that refer to
@@ -165,10 +232,11 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 }
 
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
+// page-aligned. If sparse, pages with no mapping are skipped;
+// otherwise each must be mapped or marked by uvmlazy().
 // Optionally free the physical memory.
-void
-uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
+static void
+unmaprange(pagetable_t pagetable, uint64 va, uint64 npages, int do_free, int sparse)
 {
   uint64 a;
   pte_t *pte;
@@ -177,10 +245,18 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
     panic("uvmunmap: not aligned");
 
   for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-    if((pte = walk(pagetable, a, 0)) == 0)
+    if((pte = walk(pagetable, a, 0)) == 0){
+      if(sparse)
+        continue;
       panic("uvmunmap: walk");
-    if((*pte & PTE_V) == 0)
+    }
+    if((*pte & PTE_V) == 0){
+      if(sparse || (*pte & PTE_LAZY)){
+        *pte = 0;
+        continue;
+      }
       panic("uvmunmap: not mapped");
+    }
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
     if(do_free){
@@ -191,6 +267,45 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
   }
 }
 
+// Remove npages of mappings starting from va. va must be
+// page-aligned and the mappings must exist, though pages
+// marked by uvmlazy() need not have been faulted in yet.
+// Optionally free the physical memory.
+void
+uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
+{
+  unmaprange(pagetable, va, npages, do_free, 0);
+}
+
+// Like uvmunmap(), for a range that may have holes:
+// an mmap()ed region, or a guest's RAM with pages
+// ballooned out.
+void
+uvmunmapsparse(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
+{
+  unmaprange(pagetable, va, npages, do_free, 1);
+}
+
+// Mark npages starting at page-aligned va as demand-paged,
+// so that uvmunmap() and uvmcopy() accept them unmapped.
+// Used by exec for the range its segments cover.
+// Returns -1 if out of memory for page-table pages.
+int
+uvmlazy(pagetable_t pagetable, uint64 va, uint64 npages)
+{
+  uint64 a;
+  pte_t *pte;
+
+  for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
+    if((pte = walk(pagetable, a, 1)) == 0)
+      return -1;
+    if(*pte & PTE_V)
+      panic("uvmlazy: mapped");
+    *pte = PTE_LAZY;
+  }
+  return 0;
+}
+
 // create an empty user page table.
 // returns 0 if out of memory.
 pagetable_t
@@ -299,7 +414,9 @@ uvmfree(pagetable_t pagetable, uint64 sz)
 // Given a parent process's page table, copy
 // its memory into a child's page table.
 // Copies both the page table and the
-// physical memory.
+// physical memory, except that pages nobody
+// can write (program text) are shared, and
+// pages not yet faulted in stay that way.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
@@ -313,13 +430,23 @@ uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
   for(i = 0; i < sz; i += PGSIZE){
     if((pte = walk(old, i, 0)) == 0)
       panic("uvmcopy: pte should exist");
-    if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+    if((*pte & PTE_V) == 0){
+      if((*pte & PTE_LAZY) == 0)
+        panic("uvmcopy: page not present");
+      if(uvmlazy(new, i, 1) != 0)
+        goto err;
+      continue;
+    }
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto err;
-    memmove(mem, (char*)pa, PGSIZE);
+    if((flags & (PTE_W|PTE_U)) == PTE_U){
+      kdup((void*)pa);
+      mem = (char*)pa;
+    } else {
+      if((mem = kalloc()) == 0)
+        goto err;
+      memmove(mem, (char*)pa, PGSIZE);
+    }
     if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
       kfree(mem);
       goto err;
@@ -345,6 +472,124 @@ uvmclear(pagetable_t pagetable, uint64 va)
   *pte &= ~PTE_U;
 }
 
+// Find the PTE for user page va0 of pagetable. Remembers the
+// last page the current process copied to or from, so a run of
+// small reads or writes to one buffer doesn't walk every time.
+// The PTE itself is re-read by the caller, and page-table pages
+// are only freed along with the whole table, which bumps tlbgen.
+static pte_t *
+uwalk(pagetable_t pagetable, uint64 va0)
+{
+  struct proc *p = myproc();
+  pte_t *pte;
+
+  if(p == 0 || p->pagetable != pagetable)
+    return walk(pagetable, va0, 0);
+  if(p->xlpte && p->xlva == va0 && p->xlgen == p->tlbgen)
+    return p->xlpte;
+  pte = walk(pagetable, va0, 0);
+  if(pte && (*pte & PTE_V)){
+    p->xlgen = p->tlbgen;
+    p->xlva = va0;
+    p->xlpte = pte;
+  }
+  return pte;
+}
+
+// Physical address of user page va0, or 0 if it is not mapped
+// with (at least) perm, faulting in file-backed pages.
+static uint64
+uaddr(pagetable_t pagetable, uint64 va0, int perm)
+{
+  pte_t *pte;
+
+  if(va0 >= MAXVA)
+    return 0;
+  pte = uwalk(pagetable, va0);
+  if(pte == 0 || (*pte & PTE_V) == 0){
+#ifndef VMM_GUEST
+    return vmafault(pagetable, va0, (perm & PTE_W) != 0);
+#else
+    return 0;
+#endif
+  }
+#ifndef VMM_GUEST
+  // a guest page merged by ksm.c, written for a hypercall.
+  if((perm & PTE_W) && (*pte & PTE_COW) && ksmfault(pagetable, va0) == 0)
+    pte = walk(pagetable, va0, 0);
+#endif
+  if((*pte & perm) != perm)
+    return 0;
+  if(perm & PTE_W)
+    *pte |= PTE_D;  // so a shared file mapping is written back
+  return PTE2PA(*pte);
+}
+
+// Copy n bytes between kernel and user memory. When src and
+// dst have the same word alignment, which they almost always
+// do for whole pages and buffers, move four words per loop.
+static void
+ucopy(char *dst, const char *src, uint64 n)
+{
+  uint64 *d;
+  const uint64 *s;
+
+  if((((uint64)dst ^ (uint64)src) & 7) == 0){
+    for(; n > 0 && ((uint64)dst & 7); n--)
+      *dst++ = *src++;
+    d = (uint64 *) dst;
+    s = (const uint64 *) src;
+    for(; n >= 32; n -= 32, d += 4, s += 4){
+      d[0] = s[0];
+      d[1] = s[1];
+      d[2] = s[2];
+      d[3] = s[3];
+    }
+    for(; n >= 8; n -= 8)
+      *d++ = *s++;
+    dst = (char *) d;
+    src = (const char *) s;
+  }
+  while(n-- > 0)
+    *dst++ = *src++;
+}
+
+// does word w contain a zero byte?
+#define HASZERO(w) (((w) - 0x0101010101010101UL) & ~(w) & 0x8080808080808080UL)
+
+// Copy at most n bytes of a string, stopping after a '\0'.
+// Returns the number of bytes before the '\0', and sets
+// *got_null if one was copied. Scans a word at a time
+// where alignment allows.
+static uint64
+ucopystr(char *dst, const char *src, uint64 n, int *got_null)
+{
+  char *d0 = dst;
+  uint64 w;
+
+  if((((uint64)dst ^ (uint64)src) & 7) == 0){
+    for(; n > 0 && ((uint64)src & 7); n--, src++, dst++){
+      if((*dst = *src) == '\0'){
+        *got_null = 1;
+        return dst - d0;
+      }
+    }
+    for(; n >= 8; n -= 8, src += 8, dst += 8){
+      w = *(const uint64 *) src;
+      if(HASZERO(w))
+        break;
+      *(uint64 *) dst = w;
+    }
+  }
+  for(; n > 0; n--, src++, dst++){
+    if((*dst = *src) == '\0'){
+      *got_null = 1;
+      return dst - d0;
+    }
+  }
+  return dst - d0;
+}
+
 // Copy from kernel to user.
 // Copy len bytes from src to virtual address dstva in a given page table.
 // Return 0 on success, -1 on error.
@@ -355,13 +600,12 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if((pa0 = uaddr(pagetable, va0, PTE_U|PTE_W)) == 0)
       return -1;
     n = PGSIZE - (dstva - va0);
     if(n > len)
       n = len;
-    memmove((void *)(pa0 + (dstva - va0)), src, n);
+    ucopy((char *)(pa0 + (dstva - va0)), src, n);
 
     len -= n;
     src += n;
@@ -380,13 +624,12 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if((pa0 = uaddr(pagetable, va0, PTE_U)) == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
     if(n > len)
       n = len;
-    memmove(dst, (void *)(pa0 + (srcva - va0)), n);
+    ucopy(dst, (char *)(pa0 + (srcva - va0)), n);
 
     len -= n;
     dst += n;
@@ -407,27 +650,15 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if((pa0 = uaddr(pagetable, va0, PTE_U)) == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
     if(n > max)
       n = max;
 
-    char *p = (char *) (pa0 + (srcva - va0));
-    while(n > 0){
-      if(*p == '\0'){
-        *dst = '\0';
-        got_null = 1;
-        break;
-      } else {
-        *dst = *p;
-      }
-      --n;
-      --max;
-      p++;
-      dst++;
-    }
+    n = ucopystr(dst, (char *) (pa0 + (srcva - va0)), n, &got_null);
+    dst += n;
+    max -= n;
 
     srcva = va0 + PGSIZE;
   }
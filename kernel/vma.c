@@ -0,0 +1,622 @@
+//
+// Demand-paged, file-backed user memory.
+//
+// exec() does not read a program into memory. It records each
+// loadable segment as a struct vma in the process, and the
+// pages are read from the inode by vmafault() when the program
+// first touches them, from usertrap() or from copyin()/copyout().
+//
+// mmap() adds regions the same way. Writable pages of a
+// MAP_SHARED region are written back to the file by munmap()
+// and exit(); MAP_PRIVATE pages are never written back.
+// Every process that maps a given page of a file MAP_SHARED
+// maps the same physical page, so each sees the others'
+// stores at once, as it would with fork().
+//
+// Pages of read-only private regions (program text) are the same for
+// every process mapping a given file, so they are kept in a
+// small cache keyed by inode and file offset and mapped shared
+// into each process, instead of being read and copied per exec.
+// loadguest() maps guest kernel text from the same cache,
+// and the shared pages of MAP_SHARED regions live there too.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "fs.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "fcntl.h"
+
+struct {
+  struct spinlock lock;
+  struct textpg {
+    uint dev;
+    uint inum;
+    uint off;         // file offset of the page
+    uint n;           // bytes of the page read from the file
+    uint64 pa;        // the cached page, 0 if slot unused
+    int shared;       // page of a MAP_SHARED region
+  } pg[NTEXTPG];
+  int hand;           // next slot to recycle
+  uint gen;           // bumped whenever cached text may be stale
+} textcache;
+
+void
+vmainit(void)
+{
+  initlock(&textcache.lock, "textcache");
+}
+
+// Return the region of p's address space containing va, or 0.
+struct vma*
+vmalookup(struct proc *p, uint64 va)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len > 0 && va >= v->addr && va < PGROUNDUP(v->addr + v->len))
+      return v;
+  }
+  return 0;
+}
+
+// Return 1 if any region of p overlaps [start, end).
+int
+vmaoverlap(struct proc *p, uint64 start, uint64 end)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len > 0 && start < PGROUNDUP(v->addr + v->len) && v->addr < end)
+      return 1;
+  }
+  return 0;
+}
+
+// Read n bytes at off from ip into the kernel page pa.
+// Bytes past the end of the file are left alone (zero).
+// The faulting access may be a copyout() from inside
+// readi()/writei() on this very inode, so don't try to
+// lock it again if this process already holds it.
+static int
+vmaread(struct inode *ip, uint64 pa, uint off, uint n)
+{
+  int locked, r;
+
+  locked = holdingsleep(&ip->lock);
+  if(!locked)
+    ilock(ip);
+  r = readi(ip, 0, pa, off, n);
+  if(!locked)
+    iunlock(ip);
+  return r < 0 ? -1 : 0;
+}
+
+// Write the dirty pages of MAP_SHARED region v between
+// va and va+len back to its file, without growing the file.
+static void
+vmawriteback(pagetable_t pagetable, struct vma *v, uint64 va, uint64 len)
+{
+  // as in filewrite(), stay within a log transaction's size.
+  int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+  struct inode *ip = v->ip;
+  uint64 a, pa, pgoff;
+  uint off, n, i, m;
+  pte_t *pte;
+
+  for(a = va; a < va + len; a += PGSIZE){
+    if((pte = walk(pagetable, a, 0)) == 0)
+      continue;
+    if((*pte & (PTE_V|PTE_W|PTE_D)) != (PTE_V|PTE_W|PTE_D))
+      continue;
+    pa = PTE2PA(*pte);
+    pgoff = a - v->addr;
+    if(pgoff >= v->filesz)
+      continue;
+    n = v->filesz - pgoff < PGSIZE ? v->filesz - pgoff : PGSIZE;
+    for(i = 0; i < n; i += m){
+      m = n - i < max ? n - i : max;
+      off = v->off + pgoff + i;
+      begin_op();
+      ilock(ip);
+      if(off < ip->size){
+        if(off + m > ip->size)
+          m = ip->size - off;
+        writei(ip, 0, pa + i, off, m);
+      }
+      iunlock(ip);
+      end_op();
+    }
+    *pte &= ~PTE_D;
+  }
+}
+
+// Find the cached page of ip at off. textcache.lock must be held.
+static struct textpg*
+textfind(struct inode *ip, uint off, uint n, int shared)
+{
+  struct textpg *t;
+
+  for(t = textcache.pg; t < &textcache.pg[NTEXTPG]; t++){
+    if(t->pa && t->dev == ip->dev && t->inum == ip->inum &&
+       t->off == off && t->n == n && t->shared == shared)
+      return t;
+  }
+  return 0;
+}
+
+// Choose a slot for a new page, passing over shared pages
+// that some process still maps: dropping one of those would
+// give the next process to map it a page of its own.
+// Returns 0 if there is none. textcache.lock must be held.
+static struct textpg*
+textslot(void)
+{
+  struct textpg *t;
+  int i;
+
+  for(i = 0; i < NTEXTPG; i++){
+    t = &textcache.pg[textcache.hand];
+    textcache.hand = (textcache.hand + 1) % NTEXTPG;
+    if(t->pa == 0 || !t->shared || kref((void*)t->pa) == 1)
+      return t;
+  }
+  return 0;
+}
+
+// Put page mem into slot t of the cache, and return
+// the page t held before, if any, for the caller to kfree().
+// textcache.lock must be held.
+static uint64
+textput(struct textpg *t, struct inode *ip, uint off, uint n, int shared, uint64 mem)
+{
+  uint64 old;
+
+  old = t->pa;
+  t->dev = ip->dev;
+  t->inum = ip->inum;
+  t->off = off;
+  t->n = n;
+  t->shared = shared;
+  t->pa = mem;
+  kdup((void*)mem);
+  return old;
+}
+
+// Return a page holding n bytes of ip at off followed by zeros,
+// shared with any other process that mapped the same text.
+// The caller owns one reference to the returned page.
+// ip must be locked by the caller, or unlocked.
+uint64
+textpage(struct inode *ip, uint off, uint n)
+{
+  struct textpg *t;
+  uint64 mem, old;
+  uint gen;
+
+  acquire(&textcache.lock);
+  if((t = textfind(ip, off, n, 0)) != 0){
+    kdup((void*)t->pa);
+    release(&textcache.lock);
+    return t->pa;
+  }
+  gen = textcache.gen;
+  ip->text = 1;
+  release(&textcache.lock);
+
+  if((mem = (uint64)kalloc()) == 0)
+    return 0;
+  memset((void*)mem, 0, PGSIZE);
+  if(vmaread(ip, mem, off, n) < 0){
+    kfree((void*)mem);
+    return 0;
+  }
+
+  acquire(&textcache.lock);
+  if(gen != textcache.gen || (t = textslot()) == 0){
+    // the file changed while we read it; don't cache.
+    release(&textcache.lock);
+    return mem;
+  }
+  old = textput(t, ip, off, n, 0, mem);
+  release(&textcache.lock);
+
+  if(old)
+    kfree((void*)old);
+  return mem;
+}
+
+// Return the page of ip at off for a MAP_SHARED
+// region: the one page that every process mapping it shares.
+// The caller owns one reference to the returned page.
+// Returns 0 if out of memory or cache slots.
+// ip must be locked by the caller, or unlocked.
+uint64
+sharedpage(struct inode *ip, uint off)
+{
+  struct textpg *t;
+  uint64 mem, old;
+  uint gen;
+
+  for(;;){
+    acquire(&textcache.lock);
+    if((t = textfind(ip, off, PGSIZE, 1)) != 0){
+      kdup((void*)t->pa);
+      release(&textcache.lock);
+      return t->pa;
+    }
+    gen = textcache.gen;
+    ip->text = 1;
+    release(&textcache.lock);
+
+    if((mem = (uint64)kalloc()) == 0)
+      return 0;
+    memset((void*)mem, 0, PGSIZE);
+    if(vmaread(ip, mem, off, PGSIZE) < 0){
+      kfree((void*)mem);
+      return 0;
+    }
+
+    acquire(&textcache.lock);
+    if(gen != textcache.gen){
+      // the file changed while we read it; read it again.
+      release(&textcache.lock);
+      kfree((void*)mem);
+      continue;
+    }
+    if((t = textfind(ip, off, PGSIZE, 1)) != 0){
+      // another process read it in first.
+      kdup((void*)t->pa);
+      release(&textcache.lock);
+      kfree((void*)mem);
+      return t->pa;
+    }
+    if((t = textslot()) == 0){
+      release(&textcache.lock);
+      kfree((void*)mem);
+      return 0;
+    }
+    old = textput(t, ip, off, PGSIZE, 1, mem);
+    release(&textcache.lock);
+
+    if(old)
+      kfree((void*)old);
+    return mem;
+  }
+}
+
+// Forget every cached page of ip, because
+// it is being truncated.
+void
+textinval(struct inode *ip)
+{
+  struct textpg *t;
+
+  acquire(&textcache.lock);
+  textcache.gen++;
+  ip->text = 0;
+  for(t = textcache.pg; t < &textcache.pg[NTEXTPG]; t++){
+    if(t->pa && t->dev == ip->dev && t->inum == ip->inum){
+      kfree((void*)t->pa);
+      t->pa = 0;
+    }
+  }
+  release(&textcache.lock);
+}
+
+// n bytes of ip at off have just been written, from kernel
+// address src if it is not 0. Forget the file's cached text,
+// and copy the new bytes into the shared pages of MAP_SHARED
+// regions, except the one they came from (vmawriteback()):
+// reading it back could undo another process's newer stores.
+// Callers skip this unless ip->text is set, so that writes to
+// files nobody has mapped don't take textcache.lock.
+// ip must be locked by the caller.
+void
+textwrite(struct inode *ip, uint off, uint n, uint64 src)
+{
+  struct textpg *t;
+  uint64 pa;
+  uint lo, hi;
+
+  acquire(&textcache.lock);
+  textcache.gen++;
+  ip->text = 0;
+  for(t = textcache.pg; t < &textcache.pg[NTEXTPG]; t++){
+    if(t->pa == 0 || t->dev != ip->dev || t->inum != ip->inum)
+      continue;
+    if(!t->shared){
+      kfree((void*)t->pa);
+      t->pa = 0;
+      continue;
+    }
+    ip->text = 1;
+    lo = off > t->off ? off : t->off;
+    hi = off + n < t->off + PGSIZE ? off + n : t->off + PGSIZE;
+    if(lo >= hi || PGROUNDDOWN(src) == t->pa)
+      continue;
+    // readi() may sleep, so read into the page
+    // without the lock, holding a reference.
+    pa = t->pa;
+    kdup((void*)pa);
+    release(&textcache.lock);
+    readi(ip, 0, pa + (lo - t->off), lo, hi - lo);
+    kfree((void*)pa);
+    acquire(&textcache.lock);
+  }
+  release(&textcache.lock);
+}
+
+// Drop every cached text page. Pages still mapped by some
+// process stay allocated until that process lets go of them.
+// Shared pages of MAP_SHARED regions stay cached while mapped.
+// Called by kalloc() when it runs out of memory.
+void
+textreclaim(void)
+{
+  struct textpg *t;
+
+  acquire(&textcache.lock);
+  for(t = textcache.pg; t < &textcache.pg[NTEXTPG]; t++){
+    if(t->pa && (!t->shared || kref((void*)t->pa) == 1)){
+      kfree((void*)t->pa);
+      t->pa = 0;
+    }
+  }
+  release(&textcache.lock);
+}
+
+// Handle a fault on user address va in pagetable, which must
+// be the current process's. If va lies in one of its file-backed
+// regions and the access is allowed, read the page in and map it.
+// Returns the physical address of the page, or 0 if the fault
+// is a genuine error.
+uint64
+vmafault(pagetable_t pagetable, uint64 va, int write)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  pte_t *pte;
+  uint64 pa, pgoff;
+  uint n;
+
+  if(p == 0 || p->pagetable != pagetable || va >= MAXVA)
+    return 0;
+  va = PGROUNDDOWN(va);
+  if((v = vmalookup(p, va)) == 0)
+    return 0;
+  if(write && (v->perm & PTE_W) == 0)
+    return 0;
+  if((pte = walk(pagetable, va, 0)) != 0 && (*pte & PTE_V)){
+    // hardware that leaves dirty-bit updates to software
+    // faults on the first store to a writable page.
+    if(write && (*pte & PTE_W) && (*pte & PTE_D) == 0){
+      *pte |= PTE_A | PTE_D;
+      proc_tlbchanged(p);
+      return PTE2PA(*pte);
+    }
+    return 0;  // already mapped: a real protection fault.
+  }
+
+  pgoff = va - v->addr;
+  n = 0;
+  if(pgoff < v->filesz)
+    n = v->filesz - pgoff < PGSIZE ? v->filesz - pgoff : PGSIZE;
+
+  if((v->flags & MAP_SHARED) && n > 0){
+    pa = sharedpage(v->ip, v->off + pgoff);
+  } else if((v->perm & PTE_W) == 0 && n > 0){
+    pa = textpage(v->ip, v->off + pgoff, n);
+  } else {
+    if((pa = (uint64)kalloc()) != 0){
+      memset((void*)pa, 0, PGSIZE);
+      if(n > 0 && vmaread(v->ip, pa, v->off + pgoff, n) < 0){
+        kfree((void*)pa);
+        pa = 0;
+      }
+    }
+  }
+  if(pa == 0)
+    return 0;
+
+  if(mappages(pagetable, va, PGSIZE, pa, v->perm | PTE_A | (write ? PTE_D : 0)) != 0){
+    kfree((void*)pa);
+    return 0;
+  }
+  proc_tlbchanged(p);
+  return pa;
+}
+
+// Map len bytes of f starting at off into p's address space,
+// at addr if that range is free, or else wherever there is
+// room between the heap and the trapframe. prot and flags
+// have already been checked against f by sys_mmap().
+// Returns the address of the mapping, or -1.
+uint64
+vmammap(struct proc *p, uint64 addr, uint64 len, int prot, int flags,
+        struct file *f, uint off)
+{
+  struct vma *v, *free = 0;
+  uint64 end;
+
+  len = PGROUNDUP(len);
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len == 0){
+      free = v;
+      break;
+    }
+  }
+  if(free == 0)
+    return -1;
+
+  if(addr == 0 || addr % PGSIZE != 0 || addr < PGROUNDUP(p->sz) ||
+     addr + len < addr || addr + len > TRAPFRAME ||
+     vmaoverlap(p, addr, addr + len)){
+    // choose the highest free range below the trapframe.
+    end = TRAPFRAME;
+    for(;;){
+      if(end < len || end - len < PGROUNDUP(p->sz))
+        return -1;
+      addr = end - len;
+      for(v = p->vma; v < &p->vma[NVMA]; v++){
+        if(v->len > 0 && addr < PGROUNDUP(v->addr + v->len) && v->addr < end)
+          break;
+      }
+      if(v == &p->vma[NVMA])
+        break;
+      end = v->addr;
+    }
+  }
+
+  free->addr = addr;
+  free->len = len;
+  free->filesz = len;
+  free->off = off;
+  free->perm = PTE_U | PTE_R;
+  if(prot & PROT_WRITE)
+    free->perm |= PTE_W;
+  if(prot & PROT_EXEC)
+    free->perm |= PTE_X;
+  free->flags = flags;
+  free->f = filedup(f);
+  free->ip = f->ip;
+  return addr;
+}
+
+// Unmap and free the pages of mmap()ed region v between
+// va and va+len, writing them back first if it is shared.
+static void
+vmaunmappages(pagetable_t pagetable, struct vma *v, uint64 va, uint64 len)
+{
+  if(v->flags & MAP_SHARED)
+    vmawriteback(pagetable, v, va, len);
+  uvmunmapsparse(pagetable, va, len / PGSIZE, 1);
+}
+
+// Remove len bytes of mappings starting at addr from p.
+// The range must be at the start, the end, or the whole
+// of one mmap()ed region. Returns 0, or -1 on error.
+int
+vmaunmap(struct proc *p, uint64 addr, uint64 len)
+{
+  struct vma *v;
+  uint64 end;
+
+  len = PGROUNDUP(len);
+  if(addr % PGSIZE != 0 || len == 0)
+    return -1;
+  if((v = vmalookup(p, addr)) == 0 || v->f == 0)
+    return -1;
+  end = v->addr + v->len;
+  if(addr + len < addr || addr + len > end)
+    return -1;
+  if(addr != v->addr && addr + len != end)
+    return -1;  // would leave a hole
+
+  vmaunmappages(p->pagetable, v, addr, len);
+  proc_tlbchanged(p);
+  if(len == v->len){
+    fileclose(v->f);
+    v->f = 0;
+    v->ip = 0;
+    v->len = 0;
+  } else if(addr == v->addr){
+    v->addr += len;
+    v->off += len;
+    v->len -= len;
+    v->filesz = v->filesz > len ? v->filesz - len : 0;
+  } else {
+    v->len -= len;
+    if(v->filesz > v->len)
+      v->filesz = v->len;
+  }
+  return 0;
+}
+
+// Give np the same file-backed regions as p, for fork().
+// Pages already faulted into mmap()ed regions are shared
+// if the region is MAP_SHARED or read-only, and copied
+// otherwise. Returns 0, or -1 if out of memory, in which
+// case the caller must vmaclear() np's regions.
+int
+vmadup(struct proc *np, struct proc *p)
+{
+  struct vma *v;
+  uint64 a, pa;
+  uint flags;
+  pte_t *pte;
+  char *mem;
+  int i;
+
+  for(i = 0; i < NVMA; i++){
+    v = &p->vma[i];
+    np->vma[i] = *v;
+    if(v->len == 0)
+      continue;
+    if(v->f == 0){
+      idup(v->ip);
+      continue;
+    }
+    filedup(v->f);
+    for(a = v->addr; a < v->addr + v->len; a += PGSIZE){
+      if((pte = walk(p->pagetable, a, 0)) == 0 || (*pte & PTE_V) == 0)
+        continue;
+      pa = PTE2PA(*pte);
+      flags = PTE_FLAGS(*pte);
+      if((v->flags & MAP_SHARED) || (flags & PTE_W) == 0){
+        kdup((void*)pa);
+        mem = (char*)pa;
+      } else {
+        if((mem = kalloc()) == 0)
+          return -1;
+        memmove(mem, (char*)pa, PGSIZE);
+      }
+      if(mappages(np->pagetable, a, PGSIZE, (uint64)mem, flags) != 0){
+        kfree(mem);
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+// Let go of n regions and mark them unused. mmap()ed
+// regions are written back if shared and unmapped from
+// pagetable; exec's regions leave their pages to the
+// page table's owner.
+void
+vmaclear(pagetable_t pagetable, struct vma *vma, int n)
+{
+  struct vma *v;
+  int busy = 0;
+
+  for(v = vma; v < &vma[n]; v++){
+    if(v->len > 0 && v->f){
+      vmaunmappages(pagetable, v, v->addr, v->len);
+      fileclose(v->f);
+      v->f = 0;
+      v->ip = 0;
+      v->len = 0;
+    } else if(v->len > 0){
+      busy = 1;
+    }
+  }
+  if(!busy)
+    return;
+
+  begin_op();
+  for(v = vma; v < &vma[n]; v++){
+    if(v->len > 0){
+      iput(v->ip);
+      v->ip = 0;
+      v->len = 0;
+    }
+  }
+  end_op();
+}
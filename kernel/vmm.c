@@ -13,8 +13,22 @@
 #include "hypercall.h"
 #include "elf.h"
 
+#define LOADRUN 32   // guest pages loadseg() allocates at a time
+#define HC_RESTART ((uint64)-2)  // from a hypercall: issue it again
+
+// p->vmstop: vmpause() asks a guest to stop; runguest()
+// stops it and says so; vmresume() lets it go again.
+#define VMSTOP    1
+#define VMSTOPPED 2
+#define VMGONE    3   // exiting; can't be stopped
+#define VMMOVED   4   // migrated by vmsend(); to exit
+
+#define MIGRATE_ROUNDS 8    // most rounds of vmsend() before it stops the guest
+#define MIGRATE_FINAL  64   // few enough dirty pages to stop the guest for
+
 int nextvmid = 1;
 struct spinlock vmid_lock;
+struct spinlock vmstop_lock;  // p->vmstop of every guest
 
 int flags2perm(int);
 void runguest(void);
@@ -25,6 +39,17 @@ void
 vmminit(void)
 {
   initlock(&vmid_lock, "nextvmid");
+  initlock(&vmstop_lock, "vmstop");
+}
+
+// find how many VMID bits this hart implements.
+void
+vmminithart(void)
+{
+  // the VMID field reads back with only the implemented bits set.
+  w_hgatp(HGATP_MODE_SV39X4 | ((HGATP_VMID_SIZE - 1) << HGATP_VMID_SHIFT));
+  mycpu()->vmidmax = (r_hgatp() >> HGATP_VMID_SHIFT) & (HGATP_VMID_SIZE - 1);
+  w_hgatp(0);
 }
 
 int
@@ -51,27 +76,74 @@ allocguest(struct proc *p, uint64 size)
   return 0;
 }
 
+// Allocate and map guest RAM [va, va+memsz), and read its
+// first filesz bytes from ip at off. The pages come LOADRUN at
+// a time from kallocn(), in address order, and each physically
+// contiguous run of them is read with one readi() and no
+// walkaddr(); only what the file doesn't cover is zeroed.
 static int
-loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz)
+loadseg(pagetable_t pagetable, uint64 va, uint64 memsz,
+        struct inode *ip, uint off, uint64 filesz, int perm)
 {
-  uint i, n;
-  uint64 pa;
+  uint64 pa[LOADRUN], a, n, len;
+  int i, j, m;
 
-  for(i = 0; i < sz; i += PGSIZE){
-    pa = walkaddr(pagetable, va + i);
-    if(pa == 0)
-      panic("loadseg: address should exist");
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if(readi(ip, 0, (uint64)pa, offset+i, n) != n)
+  for(a = 0; a < memsz; a += m*PGSIZE){
+    n = (PGROUNDUP(memsz) - a) / PGSIZE;
+    if((m = kallocn(pa, n < LOADRUN ? n : LOADRUN)) == 0)
       return -1;
+    for(i = 0; i < m; i++){
+      if(mappages(pagetable, va + a + i*PGSIZE, PGSIZE, pa[i], PTE_R|PTE_U|perm) != 0){
+        for(; i < m; i++)
+          kfree((void*)pa[i]);
+        return -1;
+      }
+    }
+    for(i = 0; i < m; i = j){
+      for(j = i + 1; j < m && pa[j] == pa[j-1] + PGSIZE; j++)
+        ;
+      len = 0;
+      if(a + i*PGSIZE < filesz)
+        len = filesz - (a + i*PGSIZE);
+      if(len > (j - i)*PGSIZE)
+        len = (j - i)*PGSIZE;
+      if(len > 0 && readi(ip, 0, pa[i], off + a + i*PGSIZE, len) != len)
+        return -1;
+      memset((char*)pa[i] + len, 0, (j - i)*PGSIZE - len);
+    }
   }
-
   return 0;
 }
 
+// Map read-only segment ph of ip with pages from the text
+// cache in vma.c, so that guests booted from the same file
+// share one copy of their kernel text. sz is the end of what
+// is mapped so far; returns the new end, or 0.
+static uint64
+loadtext(pagetable_t pagetable, uint64 sz, struct inode *ip, struct proghdr *ph)
+{
+  int perm = PTE_R | PTE_U | flags2perm(ph->flags);
+  uint64 va, pa;
+  uint n;
+
+  if(ph->vaddr < sz)
+    return 0;
+  if(loadseg(pagetable, sz, ph->vaddr - sz, 0, 0, 0, flags2perm(ph->flags)) < 0)
+    return 0;
+  for(va = 0; va < ph->memsz; va += PGSIZE){
+    n = 0;
+    if(va < ph->filesz)
+      n = ph->filesz - va < PGSIZE ? ph->filesz - va : PGSIZE;
+    if((pa = textpage(ip, ph->off + va, n)) == 0)
+      return 0;
+    if(mappages(pagetable, ph->vaddr + va, PGSIZE, pa, perm) != 0){
+      kfree((void*)pa);
+      return 0;
+    }
+  }
+  return PGROUNDUP(ph->vaddr + ph->memsz);
+}
+
 static int
 loadguest(struct proc *p, char *path)
 {
@@ -82,12 +154,13 @@ loadguest(struct proc *p, char *path)
   struct proghdr ph;
   pagetable_t pagetable = p->stage_pagetable;
 
+  // loading only reads the file, so only the namei() and the
+  // final iput(), which may write, need a log transaction.
   begin_op();
-
-  if((ip = namei(path)) == 0){
-    end_op();
+  ip = namei(path);
+  end_op();
+  if(ip == 0)
     return -1;
-  }
   ilock(ip);
   if(readi(ip, 0, (uint64)&elf, 0, sizeof(elf)) != sizeof(elf))
     goto bad;
@@ -106,19 +179,39 @@ loadguest(struct proc *p, char *path)
       goto bad;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
-    uint64 sz1;
-    if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz, flags2perm(ph.flags))) == 0)
+    if(ph.vaddr + ph.memsz > KERNBASE + p->sz)
+      goto bad;
+    if((ph.flags & ELF_PROG_FLAG_WRITE) == 0){
+      if((sz = loadtext(pagetable, sz, ip, &ph)) == 0)
+        goto bad;
+      continue;
+    }
+    // sz stays page-aligned: each segment ends a page.
+    if(ph.vaddr < sz)
+      goto bad;
+    if(loadseg(pagetable, sz, ph.vaddr - sz, 0, 0, 0, flags2perm(ph.flags)) < 0)
       goto bad;
-    sz = sz1;
-    if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if(loadseg(pagetable, ph.vaddr, ph.memsz, ip, ph.off, ph.filesz, flags2perm(ph.flags)) < 0)
       goto bad;
+    sz = PGROUNDUP(ph.vaddr + ph.memsz);
   }
-  iunlockput(ip);
+  iunlock(ip);
+  begin_op();
+  iput(ip);
   end_op();
+  ip = 0;
+
+  // the rest of the guest's RAM.
+  if(sz > PGROUNDUP(KERNBASE + p->sz))
+    goto bad;
+  if(loadseg(pagetable, sz, PGROUNDUP(KERNBASE + p->sz) - sz, 0, 0, 0, PTE_W|PTE_X) < 0)
+    goto bad;
   return 0;
  bad:
   if(ip){
-    iunlockput(ip);
+    iunlock(ip);
+    begin_op();
+    iput(ip);
     end_op();
   }
   return -1;
@@ -129,19 +222,26 @@ sys_mkguest(void)
 {
   char path[MAXPATH];
   struct proc *np;
-  int n, sz;
+  int n, sz, nice;
   int pid;
 
+  uint64 t0 = r_time();
+
   if((n = argstr(0, path, MAXPATH)) < 0)
     return 0;
 
   argint(1, &sz);
+  argint(2, &nice);
+  if(nice < NICE_MIN || nice > NICE_MAX)
+    return 0;
 
   np = allocproc();
   if (!np)
     return 0;
 
   np->sz = sz;
+  np->nice = nice;   // the guest's CPU share against other procs
+  np->boottime = t0;
 
   
   np->context.ra = (uint64)runguest;  
@@ -162,22 +262,157 @@ sys_mkguest(void)
   acquire(&np->lock);
   memset((char*)np->gtrapframe, 0, PGSIZE);
 
-  // Mark the state as runnable
-  np->state = RUNNABLE;
-
   // Mark current myproc as parent
   np->parent = myproc();
   np->gtrapframe->guest_hstatus = HSTATUS_VTW | HSTATUS_SPVP | HSTATUS_SPV;
   np->gtrapframe->guest_sepc = KERNBASE;
   np->gtrapframe->guest_sstatus = SSTATUS_SPP | SSTATUS_SPIE;
+  np->gtrapframe->guest_memsize = np->sz;
+
+  // Mark the state as runnable
+  setrunnable(np);
 
   // release the lock once we set the flags
   release(&np->lock);
 
+  ksmstart();
+
   return pid;
 }
 
 extern void switch_to_guest(struct gtrapframe *);
+extern void fpsave(uint64 *);
+extern void fprestore(uint64 *);
+
+// Guests' FP registers are switched lazily. A guest runs
+// with sstatus.FS Off until it uses the FP unit; the first
+// FP instruction traps, and fpclaim() loads its registers,
+// first saving the previous owner's if it dirtied them.
+// Registers stay loaded across exits and other processes
+// (the host never uses FP) until another guest claims the
+// unit. A guest only runs on CPU 0, so its registers are
+// never loaded on two harts.
+static void
+fpclaim(struct proc *p)
+{
+  struct cpu *c = mycpu();
+  struct proc *o = c->fpowner;
+
+  if(o != p){
+    w_sstatus(r_sstatus() | SSTATUS_FS_INITIAL);
+    if(o){
+      if((o->gtrapframe->guest_sstatus & SSTATUS_FS) == SSTATUS_FS_DIRTY)
+        fpsave(o->gtrapframe->guest_f);
+      o->gtrapframe->guest_sstatus &= ~SSTATUS_FS;
+    }
+    fprestore(p->gtrapframe->guest_f);
+    w_sstatus(r_sstatus() & ~SSTATUS_FS);
+    c->fpowner = p;
+  }
+  p->gtrapframe->guest_sstatus &= ~SSTATUS_FS;
+  p->gtrapframe->guest_sstatus |= SSTATUS_FS_CLEAN;
+}
+
+// The VS-level CSRs are switched when another guest is
+// loaded on the hart, as hgatp is, or when a guest stops.
+static void
+vssave(struct proc *p)
+{
+  struct gtrapframe *tf = p->gtrapframe;
+
+  tf->guest_vsstatus = r_vsstatus();
+  tf->guest_vsie = r_vsie();
+  tf->guest_vstvec = r_vstvec();
+  tf->guest_vsscratch = r_vsscratch();
+  tf->guest_vsepc = r_vsepc();
+  tf->guest_vscause = r_vscause();
+  tf->guest_vstval = r_vstval();
+  tf->guest_vsip = r_vsip();
+  tf->guest_vsatp = r_vsatp();
+}
+
+static void
+vsload(struct proc *p)
+{
+  struct gtrapframe *tf = p->gtrapframe;
+
+  w_vsstatus(tf->guest_vsstatus);
+  w_vsie(tf->guest_vsie);
+  w_vstvec(tf->guest_vstvec);
+  w_vsscratch(tf->guest_vsscratch);
+  w_vsepc(tf->guest_vsepc);
+  w_vscause(tf->guest_vscause);
+  w_vstval(tf->guest_vstval);
+  w_vsip(tf->guest_vsip);
+  w_vsatp(tf->guest_vsatp);
+}
+
+// an exiting guest's registers are of no more use,
+// and whoever is stopping it must give up.
+void
+guestdrop(struct proc *p)
+{
+  struct cpu *c;
+
+  for(c = cpus; c < &cpus[NCPU]; c++){
+    if(c->fpowner == p)
+      c->fpowner = 0;
+    if(c->guest == p)
+      c->guest = 0;
+  }
+  acquire(&vmstop_lock);
+  p->vmstop = VMGONE;
+  wakeup(&p->vmstop);
+  release(&vmstop_lock);
+}
+
+// Has guest p been asked to stop, while in a hypercall?
+// A blocking hypercall then gives up, and hypercall() has the
+// guest issue it again once it runs: the guest would otherwise
+// not stop until, say, there was console input. Reads p->vmstop
+// without vmstop_lock: vmstopwait() sets it before it takes
+// p->lock to look for p asleep, and sleep() checks it under
+// p->lock, so p cannot go to sleep unnoticed.
+int
+vmstopping(struct proc *p)
+{
+  return p->vmid && p->inhc && p->vmstop == VMSTOP;
+}
+
+// Guest p has been asked to stop: put all its state in its
+// gtrapframe, where vmsave() can read it, and wait until
+// vmresume(). A stopped guest doesn't notice kill() until
+// it is resumed, so its memory stays put meanwhile.
+static void
+vmstopped(struct proc *p)
+{
+  struct cpu *c = mycpu();
+
+  if(c->fpowner == p){
+    w_sstatus(r_sstatus() | SSTATUS_FS_INITIAL);
+    if((p->gtrapframe->guest_sstatus & SSTATUS_FS) == SSTATUS_FS_DIRTY)
+      fpsave(p->gtrapframe->guest_f);
+    w_sstatus(r_sstatus() & ~SSTATUS_FS);
+    p->gtrapframe->guest_sstatus &= ~SSTATUS_FS;
+    c->fpowner = 0;
+  }
+  if(c->guest == p){
+    vssave(p);
+    c->guest = 0;
+  }
+
+  acquire(&vmstop_lock);
+  if(p->vmstop == VMSTOP){
+    p->vmstop = VMSTOPPED;
+    wakeup(&p->vmstop);
+  }
+  while(p->vmstop == VMSTOPPED)
+    sleep(&p->vmstop, &vmstop_lock);
+  release(&vmstop_lock);
+
+  // dirtyscan() may have cleared D bits the TLB still holds.
+  hfence_gvma();
+}
 
 void
 runguest(void)
@@ -189,14 +424,43 @@ runguest(void)
 
   while(1) {
     struct proc *p = myproc();
-    uint64 hgatp = HGATP_MODE_SV39X4;
-    hgatp |= ((uint64) p->vmid) << HGATP_VMID_SHIFT;
-    hgatp |= (((uint64) p->stage_pagetable) >> PGSHIFT) & HGATP_PPN;
-    w_hgatp(hgatp);
-    w_hedeleg((1L << 0) | (1L << 3) | (1L << 8) | (1L << 12) | (1L << 13) | (1L << 15));
-    w_hideleg((1L << 2) | (1L << 6) | (1L << 10));
-    w_hcounteren(0x2);
-    w_hvip(0);
+    struct cpu *c = mycpu();
+
+    if(p->vmstop == VMSTOP){
+      vmstopped(p);
+      if(p->vmstop == VMMOVED)
+        exit(0);
+    }
+
+    // the H-extension and VS CSRs still hold this guest's
+    // values if it was the last guest to run on this hart.
+    if(c->guest != p){
+      if(c->guest)
+        vssave(c->guest);
+      // guests whose VMID doesn't fit in this hart's hgatp
+      // share VMID 0, which no other guest uses, and the TLB
+      // may hold another's translations under it.
+      uint64 vmid = p->vmid <= c->vmidmax ? p->vmid : 0;
+      uint64 hgatp = HGATP_MODE_SV39X4;
+      hgatp |= vmid << HGATP_VMID_SHIFT;
+      hgatp |= (((uint64) p->stage_pagetable) >> PGSHIFT) & HGATP_PPN;
+      w_hgatp(hgatp);
+      if(vmid == 0)
+        hfence_gvma();
+      w_hedeleg((1L << 0) | (1L << 3) | (1L << 8) | (1L << 12) | (1L << 13) | (1L << 15));
+      w_hideleg((1L << 2) | (1L << 6) | (1L << 10));
+      w_hcounteren(0x2);
+      w_hvip(0);
+      vsload(p);
+      c->guest = p;
+    }
+
+    if(p->boottime){
+      printf("guest %d: %d us %s first instruction\n", p->vmid,
+             (int)((r_time() - p->boottime) / (TIMEFREQ / 1000000)),
+             p->migrated ? "downtime, stop to" : "from start to");
+      p->boottime = 0;
+    }
 
     // Start the code of switching to the guest
     switch_to_guest((struct gtrapframe *) p->trapframe);
@@ -240,10 +504,34 @@ delegate_to_guest(void)
   p->gtrapframe->guest_sstatus |= SSTATUS_SPP;
 }
 
+// dirtyscan() needs D set in the second-stage PTE of each page
+// the guest writes. A hart that sets A and D itself does; one
+// that leaves them to software (Svade) instead takes a guest-page
+// fault on the first access through a PTE with A clear, or store
+// with D clear. Set them, and return 0 for the guest to retry,
+// or -1 if the fault was for some other reason.
+static int
+guestaccess(pagetable_t pagetable, uint64 gpa, int write)
+{
+  pte_t *pte;
+  uint64 ad = PTE_A | (write ? PTE_D : 0);
+
+  if(gpa >= MAXVA)
+    return -1;
+  pte = walk(pagetable, PGROUNDDOWN(gpa), 0);
+  if(pte == 0 || (*pte & PTE_V) == 0 || (write && (*pte & PTE_W) == 0))
+    return -1;
+  if((*pte & ad) == ad)
+    return -1;
+  *pte |= ad;
+  hfence_gvma();
+  return 0;
+}
+
 void
 guesttrap(void)
 {
-  int which_dev;
+  int which_dev = 0;
   struct proc *p = myproc();
 
   // TODO: You may have to handle other traps from the guest kernel
@@ -256,11 +544,24 @@ guesttrap(void)
 
     p->gtrapframe->guest_sepc += 4;
 
+    p->inhc = 1;
     intr_on();
 
     hypercall();
 
     intr_off();
+    p->inhc = 0;
+  } else if((r_scause() == 20 || r_scause() == 21 || r_scause() == 23) &&
+            guestaccess(p->stage_pagetable, r_htval() << 2, r_scause() == 23) == 0){
+    // first access, or store, to a page on a hart that leaves
+    // A and D to software.
+  } else if(r_scause() == 23 && ksmfault(p->stage_pagetable, r_htval() << 2) == 0){
+    // store to a page shared by ksm.c; the guest has its own copy now.
+  } else if(r_scause() == 2 &&
+            (p->gtrapframe->guest_sstatus & SSTATUS_FS) == SSTATUS_FS_OFF){
+    // illegal instruction, maybe FP: load the guest's FP
+    // registers and retry. if it still traps, it was not.
+    fpclaim(p);
   } else if((which_dev = devintr()) != 0){
     // ok
     if (which_dev == 2) {
@@ -278,6 +579,12 @@ guesttrap(void)
 
   if (killed(p))
     exit(-1);
+
+  // give up the CPU if this is a timer interrupt, so that
+  // the scheduler can share CPU 0 between guests by weight.
+  // runguest() reloads the VS CSRs if another guest ran.
+  if(which_dev == 2)
+    yield();
 }
 
 // Use this function to retrieve arguments from hypercalls
@@ -349,7 +656,14 @@ uint64 hc_consoleread(void)
     int r = n - i, s;
     if (r > PGSIZE) r = PGSIZE;
     s = consoleread(0, (uint64)buf, r);
-    if (copyout(p->stage_pagetable, dst+i, buf, r) == -1)
+    if (s < 0) {
+      if (i == 0 && vmstopping(p)) {
+        kfree(buf);
+        return HC_RESTART;
+      }
+      break;
+    }
+    if (copyout(p->stage_pagetable, dst+i, buf, s) == -1)
       break;
     i += s;
     if (s < r)
@@ -360,6 +674,99 @@ uint64 hc_consoleread(void)
   return i;
 }
 
+// Memory ballooning. sys_balloon() sets how many pages the
+// host wants back from a guest; the guest reads the number
+// with HC_balloon_target, and hands over free pages with
+// HC_balloon_inflate, or takes them back with
+// HC_balloon_deflate, up to BALLOON_BATCH at a time. Both
+// take an array of guest-physical page addresses and return
+// how many of them were done.
+#define BALLOON_BATCH 64
+
+static int
+balloonargs(uint64 *gpa)
+{
+  struct proc *p = myproc();
+  uint64 src = argraw(0);
+  int n = argraw(1);
+
+  if(n < 0)
+    return 0;
+  if(n > BALLOON_BATCH)
+    n = BALLOON_BATCH;
+  if(copyin(p->stage_pagetable, (char*)gpa, src, n*sizeof(uint64)) < 0)
+    return 0;
+  return n;
+}
+
+// is gpa the address of a page of p's RAM?
+static int
+guestpage(struct proc *p, uint64 gpa)
+{
+  return gpa % PGSIZE == 0 && gpa >= KERNBASE && gpa < KERNBASE + p->sz;
+}
+
+uint64 hc_balloon_inflate(void)
+{
+  struct proc *p = myproc();
+  uint64 gpa[BALLOON_BATCH];
+  pte_t *pte;
+  int i, n;
+
+  n = balloonargs(gpa);
+  for(i = 0; i < n; i++){
+    if(!guestpage(p, gpa[i]))
+      break;
+    if((pte = walk(p->stage_pagetable, gpa[i], 0)) == 0 || (*pte & PTE_V) == 0)
+      break;
+    kfree((void*)PTE2PA(*pte));
+    *pte = 0;
+    p->balloon++;
+  }
+  if(i > 0){
+    hfence_gvma();
+    proc_tlbchanged(p);  // drop the copyin/copyout PTE cache
+  }
+  return i;
+}
+
+uint64 hc_balloon_deflate(void)
+{
+  struct proc *p = myproc();
+  uint64 gpa[BALLOON_BATCH];
+  pte_t *pte;
+  char *mem;
+  int i, n;
+
+  n = balloonargs(gpa);
+  for(i = 0; i < n && p->balloon > 0; i++){
+    // anything but a page of guest RAM with no mapping
+    // would leave a mapping guestfree() does not undo.
+    if(!guestpage(p, gpa[i]))
+      break;
+    if((pte = walk(p->stage_pagetable, gpa[i], 0)) != 0 && (*pte & PTE_V))
+      break;  // not ballooned
+    if((mem = kalloc()) == 0)
+      break;
+    memset(mem, 0, PGSIZE);
+    if(mappages(p->stage_pagetable, gpa[i], PGSIZE, (uint64)mem,
+                PTE_R|PTE_W|PTE_X|PTE_U) != 0){
+      kfree(mem);
+      break;
+    }
+    p->balloon--;
+  }
+  return i;
+}
+
+// HC_mhartid, HC_memsize and HC_balloon_target are normally
+// answered in vmm_trampoline.S without leaving it; these are
+// for completeness.
+uint64 hc_balloon_target(void)
+{
+  return myproc()->gtrapframe->guest_balloon;
+}
+
 uint64 hc_memsize(void)
 {
   return myproc()->sz;
@@ -379,6 +786,9 @@ static uint64 (*hypercalls[])(void) = {
 [HC_consolewrite] hc_consolewrite,
 [HC_consoleread]  hc_consoleread,
 [HC_memsize]    hc_memsize,
+[HC_balloon_target]  hc_balloon_target,
+[HC_balloon_inflate] hc_balloon_inflate,
+[HC_balloon_deflate] hc_balloon_deflate,
 };
 
 void
@@ -391,9 +801,548 @@ hypercall(void)
   if(num > 0 && num < NELEM(hypercalls) && hypercalls[num]) {
     // Use num to lookup the hypercall function for num, call it,
     // and store its return value in p->gtrapframe->guest.a0
-    p->gtrapframe->guest.a0 = hypercalls[num]();
+    uint64 r = hypercalls[num]();
+    if(r == HC_RESTART)
+      p->gtrapframe->guest_sepc -= 4;  // back to the ecall
+    else
+      p->gtrapframe->guest.a0 = r;
   } else {
     printf("guest %d: unknown hypercall %d\n", p->vmid, num);
     p->gtrapframe->guest.a0 = -1;
   }
 }
+
+extern struct proc proc[NPROC];
+
+// balloon(pid, size): ask guest pid to shrink or grow to size
+// bytes of memory, or just report its size if size < 0.
+// returns the guest's current size, or -1 if pid is not a guest.
+uint64
+sys_balloon(void)
+{
+  struct proc *p;
+  int pid, size;
+  uint64 cur = -1;
+
+  argint(0, &pid);
+  argint(1, &size);
+  for(p = proc; p < &proc[NPROC]; p++){
+    acquire(&p->lock);
+    if(p->pid == pid && p->vmid && p->state != ZOMBIE){
+      if(size >= 0)
+        p->gtrapframe->guest_balloon =
+          size >= p->sz ? 0 : (p->sz - size) / PGSIZE;
+      cur = p->sz - (uint64)p->balloon * PGSIZE;
+    }
+    release(&p->lock);
+  }
+  return cur;
+}
+
+// free a guest's memory and second-stage page table.
+// p->lock must be held.
+void
+guestfree(struct proc *p)
+{
+  pagetable_t pagetable = p->stage_pagetable;
+
+  uvmunmap(pagetable, TRAMPOLINE, 1, 0);
+  uvmunmap(pagetable, TRAPFRAME, 1, 0);
+  uvmunmapsparse(pagetable, KERNBASE, PGROUNDUP(p->sz)/PGSIZE, 1);
+  uvmfree(pagetable, 0);
+  p->stage_pagetable = 0;
+  p->balloon = 0;
+}
+
+// Stop guest p, if it is still guest vmid, at its next exit,
+// and wait until it has put all its state in its gtrapframe.
+// Returns -1 if it has gone or someone else is stopping it.
+static int
+vmstopwait(struct proc *p, int vmid)
+{
+  acquire(&vmstop_lock);
+  if(p->vmid != vmid || p->vmstop != 0){
+    release(&vmstop_lock);
+    return -1;
+  }
+  p->vmstop = VMSTOP;
+  // guests run on CPU 0: make it exit now, not at its next tick.
+  kick(0);
+  // or, if it is asleep in a hypercall, wake it to give up.
+  acquire(&p->lock);
+  if(p->state == SLEEPING && p->vmid == vmid && p->inhc)
+    setrunnable(p);
+  release(&p->lock);
+  while(p->vmstop == VMSTOP){
+    if(killed(myproc())){
+      p->vmstop = 0;
+      release(&vmstop_lock);
+      return -1;
+    }
+    sleep(&p->vmstop, &vmstop_lock);
+  }
+  if(p->vmstop != VMSTOPPED){
+    release(&vmstop_lock);
+    return -1;
+  }
+  release(&vmstop_lock);
+
+  // ksmd looks at p->vmstop under p->lock; once it has let
+  // go of p->lock it won't remap p's pages.
+  acquire(&p->lock);
+  release(&p->lock);
+  return 0;
+}
+
+// Stop the guest with the given pid, as vmstopwait() does.
+// Returns the guest, to be given to vmresume(), or 0.
+static struct proc*
+vmpause(int pid)
+{
+  struct proc *p;
+  int vmid = 0;
+
+  for(p = proc; p < &proc[NPROC]; p++){
+    acquire(&p->lock);
+    if(p->pid == pid && p->vmid && p->state != ZOMBIE)
+      vmid = p->vmid;
+    release(&p->lock);
+    if(vmid)
+      break;
+  }
+  if(vmid == 0 || vmstopwait(p, vmid) < 0)
+    return 0;
+  return p;
+}
+
+static void
+vmresume(struct proc *p)
+{
+  acquire(&vmstop_lock);
+  p->vmstop = 0;
+  wakeup(&p->vmstop);
+  release(&vmstop_lock);
+}
+
+// Set bit i of bits[] if guest page i, at KERNBASE+i*PGSIZE,
+// has been written since the last call, and clear its D bit,
+// for n bits at most. Pages that are not mapped (ballooned)
+// are always marked, so that a copy unmaps them too, but not
+// counted: they cost a copier no data. The hart sets D in the
+// second-stage PTE on the first write through it, so p must be
+// stopped, and its TLB flushed before it runs again. Returns
+// the number of mapped pages marked.
+static int
+dirtyscan(struct proc *p, uchar *bits, uint64 n)
+{
+  uint64 i, npg = PGROUNDUP(p->sz) / PGSIZE;
+  pte_t *pte;
+  int nd = 0;
+
+  if(npg > n)
+    npg = n;
+  for(i = 0; i < npg; i++){
+    pte = walk(p->stage_pagetable, KERNBASE + i*PGSIZE, 0);
+    if(pte && (*pte & PTE_V) && (*pte & PTE_D) == 0)
+      continue;
+    bits[i/8] |= 1 << (i%8);
+    if(pte && (*pte & PTE_V)){
+      *pte &= ~PTE_D;
+      nd++;
+    }
+  }
+  return nd;
+}
+
+// A snapshot is a snaphdr, then snaprecs in increasing gpa
+// order, each a run of n guest pages with the same flags; the
+// run's data follows unless SNAP_ZERO or SNAP_UNMAP is set.
+// Pages in no run are not mapped (ballooned). A record with
+// n == 0 ends the snapshot, unless it has SNAP_MORE: then
+// another snaphdr and records follow, which update the guest
+// as a migration round does. It is written and read front to
+// back, so a pipe will do as well as a file.
+#define SNAP_MAGIC 0x564d534eU  // "VMSN"
+#define SNAP_ZERO  (1 << 16)    // the pages are zero
+#define SNAP_UNMAP (1 << 17)    // the pages are not mapped now
+#define SNAP_MORE  (1 << 18)    // on an end record: another round follows
+
+struct snaphdr {
+  uint magic;
+  int nice;
+  uint64 sz;                   // bytes of guest RAM
+  int balloon;                 // pages ballooned
+  int pad;
+  uint64 stopped;              // r_time() a migrating guest stopped, or 0
+  struct gtrapframe tf;
+};
+
+struct snaprec {
+  uint64 gpa;
+  uint n;
+  uint flags;                  // PTE_W|PTE_X, SNAP_*
+};
+
+// read or write all of kernel buffer buf from or to f.
+static int
+snapio(struct file *f, int write, void *buf, int n)
+{
+  int i, r;
+
+  for(i = 0; i < n; i += r){
+    if(write)
+      r = filewrite(f, 0, (uint64)buf + i, n - i);
+    else
+      r = fileread(f, 0, (uint64)buf + i, n - i);
+    if(r <= 0)
+      return -1;
+  }
+  return 0;
+}
+
+static int
+zeropage(uint64 *pa)
+{
+  int i;
+
+  for(i = 0; i < PGSIZE/8; i++)
+    if(pa[i])
+      return 0;
+  return 1;
+}
+
+static int
+snaphdr(struct proc *p, struct file *f, uint64 stopped)
+{
+  struct snaphdr *h;
+  int r;
+
+  // a snaphdr is too big for the stack.
+  if((h = kalloc()) == 0)
+    return -1;
+  memset(h, 0, sizeof(*h));
+  h->magic = SNAP_MAGIC;
+  h->nice = p->nice;
+  h->sz = p->sz;
+  h->balloon = p->balloon;
+  h->stopped = stopped;
+  h->tf = *p->gtrapframe;
+  r = snapio(f, 1, h, sizeof(*h));
+  kfree(h);
+  return r;
+}
+
+static int
+snapend(struct file *f, int more)
+{
+  struct snaprec r;
+
+  r.gpa = 0;
+  r.n = 0;
+  r.flags = more ? SNAP_MORE : 0;
+  return snapio(f, 1, &r, sizeof(r));
+}
+
+// Write records for guest p's pages to f: all mapped pages if
+// bits is 0, else those marked in bits, unmapped ones too.
+// If live, p is running, and is stopped only while a batch of
+// pages is looked up and pinned with kdup(); it may write a
+// page while the page is being sent, but then the page is
+// dirty again for the next round.
+static int
+snappages(struct proc *p, int vmid, struct file *f, uchar *bits, int live)
+{
+  uint64 pa[LOADRUN], base, end = KERNBASE + PGROUNDUP(p->sz), i;
+  int flags[LOADRUN], j, k, m, r = 0;
+  struct snaprec rec;
+  pte_t *pte;
+
+  for(base = KERNBASE; base < end; base += LOADRUN*PGSIZE){
+    m = (end - base) / PGSIZE;
+    if(m > LOADRUN)
+      m = LOADRUN;
+    if(live && vmstopwait(p, vmid) < 0)
+      return -1;
+    for(j = 0; j < m; j++){
+      i = (base - KERNBASE) / PGSIZE + j;
+      flags[j] = -1;  // not sent
+      if(bits && (bits[i/8] & (1 << (i%8))) == 0)
+        continue;
+      pte = walk(p->stage_pagetable, base + j*PGSIZE, 0);
+      if(pte == 0 || (*pte & PTE_V) == 0){
+        if(bits)
+          flags[j] = SNAP_UNMAP;
+        continue;
+      }
+      pa[j] = PTE2PA(*pte);
+      flags[j] = *pte & (PTE_W|PTE_X);
+      if(*pte & PTE_COW)
+        flags[j] |= PTE_W;
+      if(zeropage((uint64*)pa[j]))
+        flags[j] |= SNAP_ZERO;
+      else
+        kdup((void*)pa[j]);
+    }
+    if(live)
+      vmresume(p);
+
+    for(j = 0; j < m; j = k){
+      for(k = j + 1; k < m && flags[k] == flags[j]; k++)
+        ;
+      if(flags[j] < 0)
+        continue;
+      rec.gpa = base + j*PGSIZE;
+      rec.n = k - j;
+      rec.flags = flags[j];
+      if(r == 0)
+        r = snapio(f, 1, &rec, sizeof(rec));
+      if(flags[j] & (SNAP_ZERO|SNAP_UNMAP))
+        continue;
+      for(; j < k; j++){
+        if(r == 0)
+          r = snapio(f, 1, (void*)pa[j], PGSIZE);
+        kfree((void*)pa[j]);
+      }
+    }
+    if(r < 0)
+      return -1;
+  }
+  return 0;
+}
+
+// read one round of records from f into new guest p. returns
+// 1 if another round follows, 0 if not, or -1.
+static int
+snapread(struct proc *p, struct file *f)
+{
+  pagetable_t pagetable = p->stage_pagetable;
+  uint64 next = KERNBASE, end = KERNBASE + PGROUNDUP(p->sz);
+  struct snaprec r;
+  char *mem;
+  int i;
+
+  for(;;){
+    if(snapio(f, 0, &r, sizeof(r)) < 0)
+      return -1;
+    if(r.n == 0)
+      return (r.flags & SNAP_MORE) != 0;
+    if(r.gpa < next || r.gpa % PGSIZE || r.n > LOADRUN ||
+       r.gpa + (uint64)r.n*PGSIZE > end ||
+       (r.flags & ~(PTE_W|PTE_X|SNAP_ZERO|SNAP_UNMAP)))
+      return -1;
+    next = r.gpa + (uint64)r.n*PGSIZE;
+    // an earlier round may have mapped these pages.
+    uvmunmapsparse(pagetable, r.gpa, r.n, 1);
+    if(r.flags & SNAP_UNMAP)
+      continue;
+    if(r.flags & SNAP_ZERO){
+      if(loadseg(pagetable, r.gpa, (uint64)r.n*PGSIZE, 0, 0, 0, r.flags & ~SNAP_ZERO) < 0)
+        return -1;
+      continue;
+    }
+    for(i = 0; i < r.n; i++){
+      if((mem = kalloc()) == 0)
+        return -1;
+      if(snapio(f, 0, mem, PGSIZE) < 0 ||
+         mappages(pagetable, r.gpa + (uint64)i*PGSIZE, PGSIZE, (uint64)mem,
+                  PTE_R|PTE_U|r.flags) != 0){
+        kfree(mem);
+        return -1;
+      }
+    }
+  }
+}
+
+// vmsave(pid, fd): write a snapshot of a running guest to fd.
+// the guest is stopped meanwhile, and then carries on.
+uint64
+sys_vmsave(void)
+{
+  struct file *f;
+  struct proc *p;
+  int pid, r;
+
+  argint(0, &pid);
+  if(argfd(1, 0, &f) < 0 || f->writable == 0)
+    return -1;
+  if((p = vmpause(pid)) == 0)
+    return -1;
+  r = -1;
+  if(snaphdr(p, f, 0) == 0 && snappages(p, p->vmid, f, 0, 0) == 0)
+    r = snapend(f, 0);
+  vmresume(p);
+  return r;
+}
+
+// vmrestore(fd): start a guest from the snapshot in fd, where
+// it was saved, or from the stream vmsend() writes to fd, once
+// the sender stops. returns its pid, or 0.
+uint64
+sys_vmrestore(void)
+{
+  uint64 t0 = r_time();
+  struct snaphdr *h;
+  struct file *f;
+  struct proc *np;
+  int pid, more;
+
+  if(argfd(0, 0, &f) < 0 || f->readable == 0)
+    return 0;
+  if((h = kalloc()) == 0)
+    return 0;
+  if(snapio(f, 0, h, sizeof(*h)) < 0 || h->magic != SNAP_MAGIC ||
+     h->nice < NICE_MIN || h->nice > NICE_MAX || h->sz == 0 || h->sz > 0x7fffffff ||
+     (np = allocproc()) == 0){
+    kfree(h);
+    return 0;
+  }
+  np->sz = h->sz;
+  np->nice = h->nice;
+  np->context.ra = (uint64)runguest;
+  pid = np->pid;
+  release(&np->lock);
+
+  if(allocguest(np, np->sz) < 0)
+    goto bad;
+  while((more = snapread(np, f)) == 1){
+    if(snapio(f, 0, h, sizeof(*h)) < 0 || h->magic != SNAP_MAGIC || h->sz != np->sz)
+      goto bad;
+  }
+  if(more < 0 || h->balloon < 0 || h->balloon > np->sz / PGSIZE)
+    goto bad;
+  // the last header has the registers the guest stopped with.
+  // the file is not to be trusted with the host's registers,
+  // nor with the mode and FP state that sret and fpclaim()
+  // depend on: set those as sys_mkguest() does.
+  *np->gtrapframe = h->tf;
+  memset(&np->gtrapframe->host, 0, sizeof(np->gtrapframe->host));
+  np->gtrapframe->host_sstatus = 0;
+  np->gtrapframe->host_hstatus = 0;
+  np->gtrapframe->host_scounteren = 0;
+  np->gtrapframe->host_sscratch = 0;
+  np->gtrapframe->host_stvec = 0;
+  np->gtrapframe->guest_hstatus = HSTATUS_VTW | HSTATUS_SPVP | HSTATUS_SPV;
+  np->gtrapframe->guest_sstatus &= SSTATUS_SPP | SSTATUS_SPIE | SSTATUS_SIE;
+  np->gtrapframe->guest_memsize = np->sz;
+  if(np->gtrapframe->guest_balloon > np->sz / PGSIZE)
+    np->gtrapframe->guest_balloon = 0;
+  np->balloon = h->balloon;
+  np->boottime = h->stopped ? h->stopped : t0;
+  np->migrated = h->stopped != 0;
+  kfree(h);
+
+  acquire(&np->lock);
+  np->parent = myproc();
+  setrunnable(np);
+  release(&np->lock);
+
+  ksmstart();
+
+  return pid;
+
+ bad:
+  kfree(h);
+  freeproc(np);
+  return 0;
+}
+
+// vmdirty(pid, bits, n): fill the n-byte bitmap bits with the
+// guest's pages written since the last call, as dirtyscan()
+// does. returns the number of mapped pages marked, or -1.
+uint64
+sys_vmdirty(void)
+{
+  struct proc *p;
+  uchar *bits;
+  uint64 addr;
+  int pid, n, nd;
+
+  argint(0, &pid);
+  argaddr(1, &addr);
+  argint(2, &n);
+  if(n < 0 || n > PGSIZE)
+    return -1;
+  if((bits = kalloc()) == 0)
+    return -1;
+  memset(bits, 0, n);
+  if((p = vmpause(pid)) == 0){
+    kfree(bits);
+    return -1;
+  }
+  nd = dirtyscan(p, bits, (uint64)n * 8);
+  vmresume(p);
+  if(copyout(myproc()->pagetable, addr, (char*)bits, n) < 0)
+    nd = -1;
+  kfree(bits);
+  return nd;
+}
+
+// vmsend(pid, fd): migrate a running guest to the process that
+// reads fd with vmrestore(). All its pages are sent while it
+// runs, then in rounds those it wrote meanwhile, until few
+// enough are left to send with it stopped. Then it exits, and
+// its copy reports the downtime when it first runs. returns
+// the number of rounds, or -1, when the guest carries on.
+uint64
+sys_vmsend(void)
+{
+  uint64 stopped;
+  struct file *f;
+  struct proc *p;
+  uchar *bits;
+  int pid, vmid, round, nd, last;
+
+  argint(0, &pid);
+  if(argfd(1, 0, &f) < 0 || f->writable == 0)
+    return -1;
+  if((bits = kalloc()) == 0)
+    return -1;
+  if((p = vmpause(pid)) == 0){
+    kfree(bits);
+    return -1;
+  }
+  vmid = p->vmid;
+  last = PGROUNDUP(p->sz) / PGSIZE;
+  if(last > 8*PGSIZE){
+    // more pages than a page of bits covers.
+    vmresume(p);
+    kfree(bits);
+    return -1;
+  }
+  memset(bits, 0, PGSIZE);
+  dirtyscan(p, bits, 8*PGSIZE);  // from now on
+  vmresume(p);
+  if(snaphdr(p, f, 0) < 0 || snappages(p, vmid, f, 0, 1) < 0 || snapend(f, 1) < 0)
+    goto bad;
+
+  for(round = 1; ; round++){
+    if(vmstopwait(p, vmid) < 0)
+      goto bad;
+    stopped = r_time();
+    memset(bits, 0, PGSIZE);
+    nd = dirtyscan(p, bits, 8*PGSIZE);
+    // stop if few pages are left, or they aren't getting fewer.
+    if(nd <= MIGRATE_FINAL || nd >= last || round == MIGRATE_ROUNDS)
+      break;
+    last = nd;
+    vmresume(p);
+    if(snaphdr(p, f, 0) < 0 || snappages(p, vmid, f, bits, 1) < 0 || snapend(f, 1) < 0)
+      goto bad;
+  }
+
+  // p is stopped: the last round, with its registers.
+  if(snaphdr(p, f, stopped) < 0 || snappages(p, vmid, f, bits, 0) < 0 || snapend(f, 0) < 0){
+    vmresume(p);
+    goto bad;
+  }
+  acquire(&vmstop_lock);
+  p->vmstop = VMMOVED;
+  wakeup(&p->vmstop);
+  release(&vmstop_lock);
+  kfree(bits);
+  return round + 1;
+
+ bad:
+  kfree(bits);
+  return -1;
+}
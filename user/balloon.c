@@ -0,0 +1,26 @@
+// Show or set how much memory a guest has, by ballooning.
+// usage: balloon pid [kbytes]
+// The guest gives back or takes up pages over the next few
+// clock ticks, keeping some free memory for itself.
+
+#include "kernel/types.h"
+#include "user/user.h"
+
+int
+main(int argc, char *argv[])
+{
+  int pid, size, cur;
+
+  if(argc < 2){
+    fprintf(2, "usage: balloon pid [kbytes]\n");
+    exit(1);
+  }
+  pid = atoi(argv[1]);
+  size = argc > 2 ? atoi(argv[2]) * 1024 : -1;
+  if((cur = balloon(pid, size)) < 0){
+    fprintf(2, "balloon: %d is not a guest\n", pid);
+    exit(1);
+  }
+  printf("guest %d: %d KiB\n", pid, cur / 1024);
+  exit(0);
+}
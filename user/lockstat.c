@@ -0,0 +1,35 @@
+// Print contention statistics for the hottest locks.
+// usage: lockstat [n]
+
+#include "kernel/types.h"
+#include "kernel/lockstat.h"
+#include "user/user.h"
+
+#define NSTAT 32
+
+struct lockstat st[NSTAT];
+
+int
+main(int argc, char *argv[])
+{
+  int i, n;
+
+  n = 10;
+  if(argc > 1)
+    n = atoi(argv[1]);
+  if(n > NSTAT)
+    n = NSTAT;
+  if((n = lockstat(st, n)) < 0){
+    fprintf(2, "lockstat: failed\n");
+    exit(1);
+  }
+  printf("name            locks acquires contended spins maxhold\n");
+  for(i = 0; i < n; i++){
+    printf("%s", st[i].name);
+    for(int j = strlen(st[i].name); j < 16; j++)
+      printf(" ");
+    printf("%d %l %l %l %l\n", st[i].nlocks, st[i].nacquire,
+           st[i].ncontend, st[i].nspin, st[i].maxhold);
+  }
+  exit(0);
+}
@@ -0,0 +1,183 @@
+// Compare malloc/free with the first-fit allocator they
+// replaced: cycles per operation, and how much heap each
+// needs for the same live data. A workload keeps NSLOT
+// allocations and repeatedly frees a random one and
+// allocates another of a random size. Each run is in its
+// own child, so each allocator starts with an empty heap.
+
+#include "kernel/types.h"
+#include "user/user.h"
+
+#define NSLOT 500
+#define NOPS  100000
+
+// the Kernighan and Ritchie allocator, as umalloc.c had it.
+
+typedef long Align;
+
+union header {
+  struct {
+    union header *ptr;
+    uint size;
+  } s;
+  Align x;
+};
+
+typedef union header Header;
+
+static Header base;
+static Header *freep;
+
+void
+krfree(void *ap)
+{
+  Header *bp, *p;
+
+  bp = (Header*)ap - 1;
+  for(p = freep; !(bp > p && bp < p->s.ptr); p = p->s.ptr)
+    if(p >= p->s.ptr && (bp > p || bp < p->s.ptr))
+      break;
+  if(bp + bp->s.size == p->s.ptr){
+    bp->s.size += p->s.ptr->s.size;
+    bp->s.ptr = p->s.ptr->s.ptr;
+  } else
+    bp->s.ptr = p->s.ptr;
+  if(p + p->s.size == bp){
+    p->s.size += bp->s.size;
+    p->s.ptr = bp->s.ptr;
+  } else
+    p->s.ptr = bp;
+  freep = p;
+}
+
+static Header*
+morecore(uint nu)
+{
+  char *p;
+  Header *hp;
+
+  if(nu < 4096)
+    nu = 4096;
+  p = sbrk(nu * sizeof(Header));
+  if(p == (char*)-1)
+    return 0;
+  hp = (Header*)p;
+  hp->s.size = nu;
+  krfree((void*)(hp + 1));
+  return freep;
+}
+
+void*
+krmalloc(uint nbytes)
+{
+  Header *p, *prevp;
+  uint nunits;
+
+  nunits = (nbytes + sizeof(Header) - 1)/sizeof(Header) + 1;
+  if((prevp = freep) == 0){
+    base.s.ptr = freep = prevp = &base;
+    base.s.size = 0;
+  }
+  for(p = prevp->s.ptr; ; prevp = p, p = p->s.ptr){
+    if(p->s.size >= nunits){
+      if(p->s.size == nunits)
+        prevp->s.ptr = p->s.ptr;
+      else {
+        p->s.size -= nunits;
+        p += p->s.size;
+        p->s.size = nunits;
+      }
+      freep = prevp;
+      return (void*)(p + 1);
+    }
+    if(p == freep)
+      if((p = morecore(nunits)) == 0)
+        return 0;
+  }
+}
+
+static uint seed;
+
+uint
+rand(void)
+{
+  seed = seed * 1103515245 + 12345;
+  return seed >> 8;
+}
+
+// a size up to max, mostly small.
+uint
+randsize(uint max)
+{
+  uint n = rand() % max + 1;
+
+  if(rand() % 8)
+    n = n % 128 + 1;
+  return n;
+}
+
+void
+run(char *name, int kr, uint max)
+{
+  static char *slot[NSLOT];
+  static uint len[NSLOT];
+  uint live, peak;
+  char *heap0, *heap;
+  uint64 t0, t;
+  int i, j;
+
+  seed = 1;
+  live = peak = 0;
+  heap0 = sbrk(0);
+  t0 = rdcycle();
+  for(i = 0; i < NOPS; i++){
+    j = rand() % NSLOT;
+    if(slot[j]){
+      if(kr) krfree(slot[j]); else free(slot[j]);
+      live -= len[j];
+    }
+    len[j] = randsize(max);
+    slot[j] = kr ? krmalloc(len[j]) : malloc(len[j]);
+    if(slot[j] == 0){
+      fprintf(2, "mallocbench: out of memory\n");
+      exit(1);
+    }
+    slot[j][0] = 1;
+    live += len[j];
+    if(live > peak)
+      peak = live;
+  }
+  t = rdcycle() - t0;
+  heap = sbrk(0);
+  for(j = 0; j < NSLOT; j++)
+    if(kr) krfree(slot[j]); else free(slot[j]);
+  printf("%s, sizes to %d: %l cycles/op, heap %d KiB for %d KiB live, %d KiB after freeing\n",
+         name, max, t / (2*NOPS), (int)(heap - heap0) / 1024, peak / 1024,
+         (int)((char*)sbrk(0) - heap0) / 1024);
+}
+
+void
+bench(char *name, int kr, uint max)
+{
+  int pid = fork();
+
+  if(pid < 0){
+    fprintf(2, "mallocbench: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    run(name, kr, max);
+    exit(0);
+  }
+  wait(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  bench("first-fit", 1, 512);
+  bench("size-class", 0, 512);
+  bench("first-fit", 1, 16384);
+  bench("size-class", 0, 16384);
+  exit(0);
+}
@@ -0,0 +1,140 @@
+// Time the kernel's memset/memmove/memcmp against the
+// byte-at-a-time loops they replaced, for page-sized and
+// small copies. The kernel's routines are compiled in here
+// under other names, so what runs is the kernel's code.
+
+#include "kernel/types.h"
+#include "user/user.h"
+
+#define memset kmemset
+#define memmove kmemmove
+#define memcmp kmemcmp
+#define memcpy kmemcpy
+#define strncmp kstrncmp
+#define strncpy kstrncpy
+#define safestrcpy ksafestrcpy
+#define strlen kstrlen
+#include "kernel/string.c"
+#undef memset
+#undef memmove
+#undef memcmp
+#undef memcpy
+#undef strncmp
+#undef strncpy
+#undef safestrcpy
+#undef strlen
+
+#define TOTAL (32*1024*1024)   // bytes moved per measurement
+
+static uint64 bufa[4096/8 + 1];
+static uint64 bufb[4096/8 + 1];
+
+void*
+bmemset(void *dst, int c, uint n)
+{
+  char *cdst = (char *) dst;
+  int i;
+  for(i = 0; i < n; i++){
+    cdst[i] = c;
+  }
+  return dst;
+}
+
+int
+bmemcmp(const void *v1, const void *v2, uint n)
+{
+  const uchar *s1, *s2;
+
+  s1 = v1;
+  s2 = v2;
+  while(n-- > 0){
+    if(*s1 != *s2)
+      return *s1 - *s2;
+    s1++, s2++;
+  }
+  return 0;
+}
+
+void*
+bmemmove(void *dst, const void *src, uint n)
+{
+  const char *s = src;
+  char *d = dst;
+
+  while(n-- > 0)
+    *d++ = *s++;
+  return dst;
+}
+
+enum { SET, MOVE, CMP };
+
+// run one routine over TOTAL bytes in n-byte calls.
+// returns the elapsed CPU cycles.
+uint64
+run(int op, int fast, uint n, int skew)
+{
+  char *a = (char *) bufa + skew;
+  char *b = (char *) bufb;
+  int i, iters;
+  uint64 t0;
+
+  iters = TOTAL / n;
+  t0 = rdcycle();
+  for(i = 0; i < iters; i++){
+    switch(op){
+    case SET:
+      if(fast) kmemset(a, i, n); else bmemset(a, i, n);
+      break;
+    case MOVE:
+      if(fast) kmemmove(a, b, n); else bmemmove(a, b, n);
+      break;
+    case CMP:
+      if(fast) kmemcmp(a, b, n); else bmemcmp(a, b, n);
+      break;
+    }
+  }
+  return rdcycle() - t0;
+}
+
+// print TOTAL bytes per cycles, to two decimal places.
+void
+printrate(uint64 cycles)
+{
+  uint64 r;
+
+  if(cycles == 0)
+    cycles = 1;
+  r = (uint64) TOTAL * 100 / cycles;
+  printf("%l.%l%l", r / 100, r / 10 % 10, r % 10);
+}
+
+void
+report(char *name, int op, uint n, int skew)
+{
+  uint64 tb, tw;
+
+  if(op == CMP){
+    bmemset(bufa, 'x', sizeof(bufa));
+    bmemset(bufb, 'x', sizeof(bufb));
+  }
+  tb = run(op, 0, n, skew);
+  tw = run(op, 1, n, skew);
+  printf("%s %d%s: bytes ", name, n, skew ? " unaligned" : "");
+  printrate(tb);
+  printf(", words ");
+  printrate(tw);
+  printf(" bytes/cycle\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+  report("memset", SET, 4096, 0);
+  report("memset", SET, 32, 0);
+  report("memmove", MOVE, 4096, 0);
+  report("memmove", MOVE, 32, 0);
+  report("memmove", MOVE, 4000, 3);
+  report("memcmp", CMP, 4096, 0);
+  report("memcmp", CMP, 32, 0);
+  exit(0);
+}
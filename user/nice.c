@@ -0,0 +1,24 @@
+// Run a command at a different scheduling priority.
+// usage: nice n command [args...]
+
+#include "kernel/types.h"
+#include "user/user.h"
+
+int
+main(int argc, char *argv[])
+{
+  int n;
+
+  if(argc < 3){
+    fprintf(2, "usage: nice n command [args...]\n");
+    exit(1);
+  }
+  n = argv[1][0] == '-' ? -atoi(argv[1] + 1) : atoi(argv[1]);
+  if(setnice(getpid(), n) < 0){
+    fprintf(2, "nice: bad priority %s\n", argv[1]);
+    exit(1);
+  }
+  exec(argv[2], argv + 2);
+  fprintf(2, "nice: exec %s failed\n", argv[2]);
+  exit(1);
+}
@@ -0,0 +1,28 @@
+// List processes, with their priority and CPU time.
+
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "kernel/memlayout.h"
+#include "kernel/procinfo.h"
+#include "user/user.h"
+
+struct procinfo pi[NPROC];
+
+int
+main(int argc, char *argv[])
+{
+  int i, n;
+  uint64 ms;
+
+  if((n = procinfo(pi, NPROC)) < 0){
+    fprintf(2, "ps: procinfo failed\n");
+    exit(1);
+  }
+  printf("pid nice vm state  ms name\n");
+  for(i = 0; i < n; i++){
+    ms = pi[i].runtime / (TIMEFREQ / 1000);
+    printf("%d %d %d %s %l %s\n", pi[i].pid, pi[i].nice, pi[i].vmid,
+           pi[i].state, ms, pi[i].name);
+  }
+  exit(0);
+}
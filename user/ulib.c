@@ -14,6 +14,151 @@ _main()
   exit(0);
 }
 
+//
+// Output buffering for printf(). Each call formats into a
+// buffer and writes it with one write(), not one per byte.
+// Output to fd 1 or 2 that isn't the console stays buffered
+// until the buffer fills, or fflush(), exit(), fork() or
+// exec(); console output and other fds are written at the
+// end of each printf(). A write() to fd 1 or 2 flushes both
+// first, so that it stays in order with printf()s before it.
+// Whether fd 1 or 2 is the console is found out on its first
+// printf(), and again after close() or dup() changes it.
+//
+#define OBUFSZ 512
+
+struct obuf {
+  int fd;
+  int console;     // 1 if fd is the console, 0 if not, -1 if unknown
+  int n;
+  char buf[OBUFSZ];
+};
+
+static struct obuf obufs[3] = {
+  { .fd = -1 }, { .fd = 1, .console = -1 }, { .fd = 2, .console = -1 },
+};
+
+static struct obuf*
+obuf(int fd)
+{
+  if(fd == 1 || fd == 2)
+    return &obufs[fd];
+  // any other fd: obufs[0], emptied by bputdone().
+  if(obufs[0].fd != fd){
+    fflush(obufs[0].fd);
+    obufs[0].fd = fd;
+    obufs[0].console = 0;
+  }
+  return &obufs[0];
+}
+
+void
+fflush(int fd)
+{
+  struct obuf *b;
+
+  for(b = obufs; b < &obufs[3]; b++){
+    if(b->fd == fd && b->n > 0){
+      _write(fd, b->buf, b->n);
+      b->n = 0;
+    }
+  }
+}
+
+static void
+flushall(void)
+{
+  fflush(obufs[0].fd);
+  fflush(1);
+  fflush(2);
+}
+
+void
+bputc(int fd, char c)
+{
+  struct obuf *b = obuf(fd);
+
+  if(b->n == OBUFSZ)
+    fflush(fd);
+  b->buf[b->n++] = c;
+}
+
+// the end of one printf() to fd.
+void
+bputdone(int fd)
+{
+  struct obuf *b = obuf(fd);
+  struct stat st;
+
+  if(b->console < 0)
+    b->console = fstat(fd, &st) == 0 && st.type == T_DEVICE;
+  if(b->console || b == &obufs[0]){
+    fflush(fd);
+  } else if(fd == 2){
+    // keep stdout's output ahead of the error message.
+    fflush(1);
+  }
+}
+
+int
+fork(void)
+{
+  flushall();  // else the child would write it too
+  return _fork();
+}
+
+int
+exec(const char *path, char **argv)
+{
+  flushall();
+  return _exec(path, argv);
+}
+
+int
+exit(int status)
+{
+  flushall();
+  _exit(status);
+}
+
+int
+write(int fd, const void *p, int n)
+{
+  if(fd == 1 || fd == 2){
+    fflush(1);
+    fflush(2);
+  }
+  return _write(fd, p, n);
+}
+
+// fd no longer refers to what it did: write out what is
+// buffered for it, and find out afresh whether it's the console.
+static void
+bufreset(int fd)
+{
+  fflush(fd);
+  if(fd == 1 || fd == 2)
+    obufs[fd].console = -1;
+}
+
+int
+close(int fd)
+{
+  bufreset(fd);
+  return _close(fd);
+}
+
+int
+dup(int fd)
+{
+  int nfd;
+
+  fflush(fd);
+  if((nfd = _dup(fd)) >= 0)
+    bufreset(nfd);
+  return nfd;
+}
+
 char*
 strcpy(char *s, const char *t)
 {
@@ -145,3 +290,23 @@ memcpy(void *dst, const void *src, uint n)
 {
   return memmove(dst, src, n);
 }
+
+// the time CSR, which counts TIMEFREQ (see kernel/memlayout.h)
+// cycles per second since boot. the kernel lets user code
+// read it and the cycle counter directly.
+uint64
+rdtime(void)
+{
+  uint64 x;
+  asm volatile("rdtime %0" : "=r" (x));
+  return x;
+}
+
+// CPU cycles since boot.
+uint64
+rdcycle(void)
+{
+  uint64 x;
+  asm volatile("rdcycle %0" : "=r" (x));
+  return x;
+}
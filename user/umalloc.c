@@ -3,88 +3,335 @@
 #include "user/user.h"
 #include "kernel/param.h"
 
-// Memory allocator by Kernighan and Ritchie,
-// The C programming Language, 2nd ed.  Section 8.7.
+// Memory allocator.
+//
+// Requests of up to SMALLMAX bytes come from slabs: runs of
+// equal-sized blocks of one size class, each slab with its own
+// free list, so small malloc() and free() take constant time.
+// Larger requests, and the slabs themselves, come from a heap
+// of variable-sized blocks kept on free lists binned by size.
+// Every heap block records its own size and its predecessor's,
+// so free() merges a block with free neighbours in constant
+// time, and a big enough free block at the top of the heap is
+// handed back to the kernel with sbrk(-n).
 
-typedef long Align;
+#define HDRSZ    16            // block header: prevsize/slab and size
+#define MINBLK   32            // smallest heap block: header, next, prev
+#define INUSE    1             // flags in the low bits of size
+#define SMALL    2
+#define SIZE(b)  ((b)->size & ~(uint64)(INUSE|SMALL))
+#define NEXT(b)  ((Block*)((char*)(b) + SIZE(b)))
+#define PREV(b)  ((Block*)((char*)(b) - (b)->prevsize))
 
-union header {
-  struct {
-    union header *ptr;
-    uint size;
-  } s;
-  Align x;
+#define GROW     (16*1024)     // least heap growth per sbrk()
+#define TRIM     (64*1024)     // least free top block to give back
+#define NBIN     32
+#define SLABSZ   4096          // least bytes of blocks per slab
+
+typedef struct block {
+  union {
+    uint64 prevsize;           // heap block: size of the one before, 0 if none
+    struct slab *slab;         // small block: the slab holding it
+  };
+  uint64 size;                 // bytes, including this header, | flags
+  struct block *next;          // on a free list only
+  struct block *prev;
+} Block;
+
+struct slab {
+  struct slab *next;           // the class's slabs with free blocks
+  struct slab *prev;
+  Block *free;
+  int cls;
+  int nfree;
+  int nblk;
 };
 
-typedef union header Header;
+#define SLABHDR  ((sizeof(struct slab) + 15) & ~15)
 
-static Header base;
-static Header *freep;
+// block sizes of the small classes, headers included.
+static uint64 clsize[] = { 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024 };
+#define NCLASS   (sizeof(clsize)/sizeof(clsize[0]))
+#define SMALLMAX (1024 - HDRSZ)
 
-void
-free(void *ap)
+static uchar clsof[SMALLMAX/16 + 1];   // class for a request of 16*i bytes
+static int ready;
+static struct slab *partial[NCLASS];   // slabs with free blocks
+static Block *bins[NBIN];              // free heap blocks
+static char *heapend;                  // break after our last sbrk()
+static Block *endmark;                 // end marker of the region ending there
+
+static int
+binof(uint64 size)
+{
+  int i;
+
+  // bin 0 holds 32..63 bytes, bin 1 64..127, and so on.
+  size >>= 6;
+  for(i = 0; size > 0 && i < NBIN-1; i++)
+    size >>= 1;
+  return i;
+}
+
+static void
+binput(Block *b)
+{
+  Block **bp = &bins[binof(b->size)];
+
+  b->prev = 0;
+  b->next = *bp;
+  if(*bp)
+    (*bp)->prev = b;
+  *bp = b;
+}
+
+static void
+binremove(Block *b)
+{
+  if(b->prev)
+    b->prev->next = b->next;
+  else
+    bins[binof(b->size)] = b->next;
+  if(b->next)
+    b->next->prev = b->prev;
+}
+
+// mark heap block b free and merge it with free neighbours.
+// returns the merged block, not yet on a free list.
+static Block*
+hmerge(Block *b)
+{
+  Block *n;
+
+  b->size &= ~INUSE;
+  n = NEXT(b);
+  if(!(n->size & INUSE)){
+    binremove(n);
+    b->size += n->size;
+  }
+  if(b->prevsize && !(PREV(b)->size & INUSE)){
+    n = PREV(b);
+    binremove(n);
+    n->size += b->size;
+    b = n;
+  }
+  NEXT(b)->prevsize = b->size;
+  return b;
+}
+
+// give free block b back to the kernel if it is large and
+// ends the heap. returns 1 if it did.
+static int
+trim(Block *b)
 {
-  Header *bp, *p;
-
-  bp = (Header*)ap - 1;
-  for(p = freep; !(bp > p && bp < p->s.ptr); p = p->s.ptr)
-    if(p >= p->s.ptr && (bp > p || bp < p->s.ptr))
-      break;
-  if(bp + bp->s.size == p->s.ptr){
-    bp->s.size += p->s.ptr->s.size;
-    bp->s.ptr = p->s.ptr->s.ptr;
-  } else
-    bp->s.ptr = p->s.ptr;
-  if(p + p->s.size == bp){
-    p->s.size += bp->s.size;
-    p->s.ptr = bp->s.ptr;
-  } else
-    p->s.ptr = bp;
-  freep = p;
+  int n;
+
+  if(b->size < TRIM || NEXT(b) != endmark)
+    return 0;
+  if(sbrk(0) != heapend)
+    return 0;  // someone else has called sbrk() since
+  // b becomes the end marker.
+  b->size = INUSE;
+  endmark = b;
+  n = heapend - ((char*)b + HDRSZ);
+  heapend -= n;
+  sbrk(-n);
+  return 1;
 }
 
-static Header*
-morecore(uint nu)
+// add at least need bytes of free heap. a region ends with
+// an in-use, zero-sized marker block, so NEXT() of a region's
+// last block never leaves the region.
+static int
+morecore(uint64 need)
 {
+  uint64 n;
   char *p;
-  Header *hp;
+  Block *b, *e;
+
+  if(need > 0x7fffffff - GROW)
+    return -1;
+  n = (need + 2*HDRSZ + 4095) & ~4095;
+  if(n < GROW)
+    n = GROW;
+  if((p = sbrk(n)) == (char*)-1){
+    n = need + 4*HDRSZ;  // room to align both ends
+    if((p = sbrk(n)) == (char*)-1)
+      return -1;
+  }
+  if(p == heapend){
+    // extends the last region: its end marker becomes
+    // the header of the new block.
+    b = endmark;
+  } else {
+    b = (Block*)(((uint64)p + 15) & ~15);
+    b->prevsize = 0;
+  }
+  e = (Block*)((uint64)(p + n - HDRSZ) & ~15);
+  b->size = ((char*)e - (char*)b) | INUSE;
+  e->prevsize = SIZE(b);
+  e->size = INUSE;
+  endmark = e;
+  heapend = p + n;
+  binput(hmerge(b));
+  return 0;
+}
+
+// allocate a heap block of need bytes, header included.
+static Block*
+halloc(uint64 need)
+{
+  Block *b, *r;
+  int i;
+
+  for(;;){
+    for(i = binof(need); i < NBIN; i++)
+      for(b = bins[i]; b; b = b->next)
+        if(b->size >= need)
+          goto found;
+    if(morecore(need) < 0)
+      return 0;
+  }
+
+found:
+  binremove(b);
+  if(b->size - need >= MINBLK){
+    r = (Block*)((char*)b + need);
+    r->prevsize = need;
+    r->size = b->size - need;
+    NEXT(r)->prevsize = r->size;
+    b->size = need;
+    binput(r);
+  }
+  b->size |= INUSE;
+  return b;
+}
 
-  if(nu < 4096)
-    nu = 4096;
-  p = sbrk(nu * sizeof(Header));
-  if(p == (char*)-1)
+static void
+hfree(Block *b)
+{
+  b = hmerge(b);
+  if(!trim(b))
+    binput(b);
+}
+
+static struct slab*
+newslab(int c)
+{
+  uint64 bsz = clsize[c], n;
+  struct slab *s;
+  Block *h, *b;
+  int i;
+
+  n = SLABSZ / bsz;
+  if(n < 8)
+    n = 8;
+  if((h = halloc(HDRSZ + SLABHDR + n*bsz)) == 0)
     return 0;
-  hp = (Header*)p;
-  hp->s.size = nu;
-  free((void*)(hp + 1));
-  return freep;
+  s = (struct slab*)((char*)h + HDRSZ);
+  s->cls = c;
+  s->nblk = s->nfree = n;
+  s->free = 0;
+  for(i = n-1; i >= 0; i--){
+    b = (Block*)((char*)s + SLABHDR + i*bsz);
+    b->slab = s;
+    b->size = bsz | INUSE | SMALL;
+    b->next = s->free;
+    s->free = b;
+  }
+  s->prev = 0;
+  s->next = partial[c];
+  if(s->next)
+    s->next->prev = s;
+  partial[c] = s;
+  return s;
 }
 
-void*
-malloc(uint nbytes)
+static void
+slabremove(struct slab *s)
+{
+  if(s->prev)
+    s->prev->next = s->next;
+  else
+    partial[s->cls] = s->next;
+  if(s->next)
+    s->next->prev = s->prev;
+}
+
+static void*
+smalloc(int c)
+{
+  struct slab *s;
+  Block *b;
+
+  if((s = partial[c]) == 0 && (s = newslab(c)) == 0)
+    return 0;
+  b = s->free;
+  s->free = b->next;
+  if(--s->nfree == 0)
+    slabremove(s);  // full, until a block comes back
+  return (char*)b + HDRSZ;
+}
+
+static void
+sfree(Block *b)
 {
-  Header *p, *prevp;
-  uint nunits;
+  struct slab *s = b->slab;
+  int c = s->cls;
 
-  nunits = (nbytes + sizeof(Header) - 1)/sizeof(Header) + 1;
-  if((prevp = freep) == 0){
-    base.s.ptr = freep = prevp = &base;
-    base.s.size = 0;
+  b->next = s->free;
+  s->free = b;
+  if(s->nfree++ == 0){
+    s->prev = 0;
+    s->next = partial[c];
+    if(s->next)
+      s->next->prev = s;
+    partial[c] = s;
+  } else if(s->nfree == s->nblk && (partial[c] != s || s->next)){
+    // empty, and not the class's only slab with room.
+    slabremove(s);
+    hfree((Block*)((char*)s - HDRSZ));
   }
-  for(p = prevp->s.ptr; ; prevp = p, p = p->s.ptr){
-    if(p->s.size >= nunits){
-      if(p->s.size == nunits)
-        prevp->s.ptr = p->s.ptr;
-      else {
-        p->s.size -= nunits;
-        p += p->s.size;
-        p->s.size = nunits;
-      }
-      freep = prevp;
-      return (void*)(p + 1);
-    }
-    if(p == freep)
-      if((p = morecore(nunits)) == 0)
-        return 0;
+}
+
+static void
+mkclasses(void)
+{
+  int i, c;
+
+  c = 0;
+  for(i = 0; i <= SMALLMAX/16; i++){
+    while(clsize[c] - HDRSZ < 16*i)
+      c++;
+    clsof[i] = c;
   }
+  ready = 1;
+}
+
+void
+free(void *ap)
+{
+  Block *b;
+
+  if(ap == 0)
+    return;
+  b = (Block*)((char*)ap - HDRSZ);
+  if(b->size & SMALL)
+    sfree(b);
+  else
+    hfree(b);
+}
+
+void*
+malloc(uint nbytes)
+{
+  Block *b;
+
+  if(!ready)
+    mkclasses();
+  if(nbytes <= SMALLMAX)
+    return smalloc(clsof[(nbytes + 15) / 16]);
+  if((b = halloc(((uint64)nbytes + HDRSZ + 15) & ~15)) == 0)
+    return 0;
+  return (char*)b + HDRSZ;
 }
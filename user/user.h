@@ -1,4 +1,7 @@
 struct stat;
+struct lockstat;
+struct procinfo;
+struct timespec;
 
 // system calls
 int fork(void);
@@ -22,7 +25,25 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
-int mkguest(const char*, int);
+int mkguest(const char*, int, int);
+void* mmap(void*, uint64, int, int, int, uint);
+int munmap(void*, uint64);
+int lockstat(struct lockstat*, int);
+int setnice(int, int);
+int procinfo(struct procinfo*, int);
+int clock_gettime(int, struct timespec*);
+int nanosleep(const struct timespec*);
+int balloon(int, int);
+int vmsave(int, int);
+int vmrestore(int);
+int vmdirty(int, uchar*, int);
+int vmsend(int, int);
+int _fork(void);
+int _exit(int) __attribute__((noreturn));
+int _exec(const char*, char**);
+int _write(int, const void*, int);
+int _close(int);
+int _dup(int);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -40,3 +61,8 @@ void free(void*);
 int atoi(const char*);
 int memcmp(const void *, const void *, uint);
 void *memcpy(void *, const void *, uint);
+uint64 rdtime(void);
+uint64 rdcycle(void);
+void bputc(int, char);
+void bputdone(int);
+void fflush(int);
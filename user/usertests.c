@@ -7,6 +7,9 @@
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
+#include "kernel/lockstat.h"
+#include "kernel/procinfo.h"
+#include "kernel/time.h"
 
 //
 // Tests xv6 system calls.  usertests without arguments runs them all
@@ -2571,6 +2574,620 @@ badarg(char *s)
   exit(0);
 }
 
+// mmap() a file both privately and shared, check that the
+// pages hold the file, that stores to a shared mapping reach
+// the file on munmap(), and that private stores don't, and
+// that two processes mapping the file shared see each other's
+// stores before either unmaps it, even through a read-only
+// mapping.
+void
+mmaptest(char *s)
+{
+  int fd, i, pid, xstatus, fds[2], back[2];
+  char *p, *q, buf[16];
+  int n = 2*PGSIZE + 100;
+
+  unlink("mmapfile");
+  fd = open("mmapfile", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < n; i++){
+    char c = 'a' + i % 26;
+    if(write(fd, &c, 1) != 1){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+
+  // a length that would wrap when rounded up to pages.
+  if(mmap(0, -1, PROT_READ, MAP_PRIVATE, fd, 0) != (char*)-1){
+    printf("%s: mmap of length -1 succeeded\n", s);
+    exit(1);
+  }
+
+  p = mmap(0, n, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(p == (char*)-1){
+    printf("%s: mmap private failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < n; i++){
+    if(p[i] != 'a' + i % 26){
+      printf("%s: wrong byte %d in private mapping\n", s, i);
+      exit(1);
+    }
+  }
+  if(p[n] != 0 || p[3*PGSIZE-1] != 0){
+    printf("%s: mapping past end of file not zero\n", s);
+    exit(1);
+  }
+  p[0] = 'X';
+  if(munmap(p, 3*PGSIZE) < 0){
+    printf("%s: munmap private failed\n", s);
+    exit(1);
+  }
+
+  p = mmap(0, n, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(p == (char*)-1){
+    printf("%s: mmap shared failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(p[0] != 'a'){
+    printf("%s: private store reached the file\n", s);
+    exit(1);
+  }
+
+  // a forked child shares the pages of a shared mapping.
+  if(p[PGSIZE] != 'a' + PGSIZE % 26){
+    printf("%s: wrong byte in shared mapping\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    p[PGSIZE] = 'Y';
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0 || p[PGSIZE] != 'Y'){
+    printf("%s: child's store not visible\n", s);
+    exit(1);
+  }
+
+  p[0] = 'Z';
+  if(munmap(p, PGSIZE) < 0 || munmap(p + PGSIZE, 2*PGSIZE) < 0){
+    printf("%s: munmap shared failed\n", s);
+    exit(1);
+  }
+
+  fd = open("mmapfile", O_RDONLY);
+  if(read(fd, buf, 1) != 1 || buf[0] != 'Z'){
+    printf("%s: shared store not written back\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  // a process that maps the file on its own shares the pages
+  // of another's shared mapping too.
+  if(pipe(fds) != 0 || pipe(back) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    fd = open("mmapfile", O_RDWR);
+    p = mmap(0, n, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if(p == (char*)-1)
+      exit(1);
+    close(fd);
+    p[1] = 'C';
+    write(fds[1], "x", 1);
+    read(back[0], buf, 1);
+    exit(p[2] == 'P' ? 0 : 2);
+  }
+  close(fds[1]);
+  close(back[0]);
+  if(read(fds[0], buf, 1) != 1){
+    printf("%s: child failed\n", s);
+    exit(1);
+  }
+  fd = open("mmapfile", O_RDWR);
+  p = mmap(0, n, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(p == (char*)-1){
+    printf("%s: second mmap shared failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(p[1] != 'C'){
+    printf("%s: other process's store not visible\n", s);
+    exit(1);
+  }
+  p[2] = 'P';
+  write(back[1], "x", 1);
+  close(fds[0]);
+  close(back[1]);
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: store not visible to other process\n", s);
+    exit(1);
+  }
+
+  fd = open("mmapfile", O_RDONLY);
+  q = mmap(0, n, PROT_READ, MAP_SHARED, fd, 0);
+  if(q == (char*)-1){
+    printf("%s: read-only mmap shared failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(q[1] != 'C'){
+    printf("%s: wrong byte in read-only shared mapping\n", s);
+    exit(1);
+  }
+  p[1] = 'W';
+  if(q[1] != 'W'){
+    printf("%s: store not visible through read-only mapping\n", s);
+    exit(1);
+  }
+  munmap(q, n);
+  munmap(p, n);
+  unlink("mmapfile");
+}
+
+// lockstat() should report the pipe lock that this test
+// just used, with the hottest locks first.
+void
+lockstattest(char *s)
+{
+  static struct lockstat st[32];
+  int fds[2], i, n;
+  char c;
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 10; i++){
+    if(write(fds[1], "x", 1) != 1 || read(fds[0], &c, 1) != 1){
+      printf("%s: pipe i/o failed\n", s);
+      exit(1);
+    }
+  }
+  if(lockstat(st, 0) != 0){
+    printf("%s: lockstat(0) returned entries\n", s);
+    exit(1);
+  }
+  n = lockstat(st, 32);
+  if(n <= 0){
+    printf("%s: lockstat failed\n", s);
+    exit(1);
+  }
+  for(i = 1; i < n; i++){
+    if(st[i].nspin > st[i-1].nspin){
+      printf("%s: not sorted\n", s);
+      exit(1);
+    }
+  }
+  for(i = 0; i < n; i++)
+    if(strcmp(st[i].name, "pipe") == 0)
+      break;
+  if(i == n || st[i].nlocks < 1 || st[i].nacquire < 20){
+    printf("%s: pipe lock missing\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// setnice() should check its range, and procinfo() should
+// report the new priority and some CPU time used.
+void
+nicetest(char *s)
+{
+  static struct procinfo pi[NPROC];
+  int i, n, t0;
+
+  if(setnice(getpid(), NICE_MAX + 1) != -1 || setnice(getpid(), NICE_MIN - 1) != -1){
+    printf("%s: setnice accepted a bad priority\n", s);
+    exit(1);
+  }
+  if(setnice(getpid(), 5) != 0){
+    printf("%s: setnice failed\n", s);
+    exit(1);
+  }
+  t0 = uptime();
+  while(uptime() < t0 + 2)
+    ;
+  n = procinfo(pi, NPROC);
+  for(i = 0; i < n; i++)
+    if(pi[i].pid == getpid())
+      break;
+  if(n <= 0 || i == n){
+    printf("%s: procinfo didn't list this process\n", s);
+    exit(1);
+  }
+  if(pi[i].nice != 5 || pi[i].runtime == 0){
+    printf("%s: nice %d runtime %l\n", s, pi[i].nice, pi[i].runtime);
+    exit(1);
+  }
+}
+
+// rdtime and clock_gettime() should agree, nanosleep() should
+// sleep at least as long as asked but wake within a few
+// milliseconds of it, and sleep(2) should end at the second
+// clock tick from now. the late bounds are well under a tick,
+// so a clock that is a tick off fails; they are retried, in
+// case some other process held the CPU when the sleep ended.
+void
+clocktest(char *s)
+{
+  struct timespec ts;
+  uint64 t0, t1, ns, slack;
+  int try;
+
+  t0 = rdtime();
+  if(clock_gettime(CLOCK_MONOTONIC, &ts) != 0){
+    printf("%s: clock_gettime failed\n", s);
+    exit(1);
+  }
+  t1 = rdtime();
+  ns = ts.tv_sec * 1000000000 + ts.tv_nsec;
+  if(ts.tv_nsec >= 1000000000 ||
+     ns < t0 * (1000000000 / TIMEFREQ) || ns > t1 * (1000000000 / TIMEFREQ)){
+    printf("%s: clock_gettime disagrees with rdtime\n", s);
+    exit(1);
+  }
+  if(clock_gettime(CLOCK_MONOTONIC + 1, &ts) != -1){
+    printf("%s: clock_gettime accepted a bad clock\n", s);
+    exit(1);
+  }
+
+  slack = TICKINTERVAL / 2;
+  if(slack > TIMEFREQ / 200)
+    slack = TIMEFREQ / 200;
+  for(try = 0; ; try++){
+    ts.tv_sec = 0;
+    ts.tv_nsec = 3000000;
+    t0 = rdtime();
+    if(nanosleep(&ts) != 0){
+      printf("%s: nanosleep failed\n", s);
+      exit(1);
+    }
+    t1 = rdtime();
+    if(t1 - t0 < TIMEFREQ / 1000 * 3){
+      printf("%s: nanosleep woke early\n", s);
+      exit(1);
+    }
+    if(t1 - t0 <= TIMEFREQ / 1000 * 3 + slack)
+      break;
+    if(try == 2){
+      printf("%s: nanosleep woke %l cycles late\n", s, t1 - t0 - TIMEFREQ / 1000 * 3);
+      exit(1);
+    }
+  }
+
+  for(try = 0; ; try++){
+    t0 = rdtime();
+    if(sleep(2) != 0){
+      printf("%s: sleep failed\n", s);
+      exit(1);
+    }
+    t1 = rdtime();
+    if(t1 - t0 < TICKINTERVAL){
+      printf("%s: sleep(2) took less than a tick\n", s);
+      exit(1);
+    }
+    if(t1 - t0 <= 2 * TICKINTERVAL + slack)
+      break;
+    if(try == 2){
+      printf("%s: sleep(2) took %l cycles, tick is %l\n", s, t1 - t0, TICKINTERVAL);
+      exit(1);
+    }
+  }
+}
+
+// fork a process that kills pid after secs seconds, so that a
+// test that would hang on a lost wakeup fails instead. returns
+// its pid, for the test to kill() and wait() for when done.
+int
+watchdog(int pid, int secs)
+{
+  int wpid;
+
+  wpid = fork();
+  if(wpid < 0){
+    printf("watchdog: fork failed\n");
+    exit(1);
+  }
+  if(wpid == 0){
+    sleep(secs * TICKHZ);
+    printf("watchdog: test %d hung\n", pid);
+    kill(pid);
+    exit(0);
+  }
+  return wpid;
+}
+
+// many processes asleep on a few channels, several to a
+// channel and the channels likely to share wait queues,
+// should each wake up once there is something for it.
+void
+wakeuptest(char *s)
+{
+  enum { NPIPE = 8, PER = 3 };
+  int fds[2], wfd[NPIPE], done[2], i, j, pid, wpid, xstatus;
+  char c;
+
+  if(pipe(done) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < NPIPE; i++){
+    if(pipe(fds) != 0){
+      printf("%s: pipe() failed\n", s);
+      exit(1);
+    }
+    for(j = 0; j < PER; j++){
+      pid = fork();
+      if(pid < 0){
+        printf("%s: fork failed\n", s);
+        exit(1);
+      }
+      if(pid == 0){
+        if(read(fds[0], &c, 1) != 1)
+          exit(1);
+        write(done[1], "x", 1);
+        exit(0);
+      }
+    }
+    close(fds[0]);
+    wfd[i] = fds[1];
+  }
+  close(done[1]);
+
+  wpid = watchdog(getpid(), 10);
+  sleep(1);  // let the readers go to sleep
+  for(i = NPIPE - 1; i >= 0; i--){
+    for(j = 0; j < PER; j++){
+      if(write(wfd[i], "y", 1) != 1){
+        printf("%s: write failed\n", s);
+        exit(1);
+      }
+    }
+    close(wfd[i]);
+  }
+  for(i = 0; i < NPIPE*PER; i++){
+    if(read(done[0], &c, 1) != 1){
+      printf("%s: a reader never woke up\n", s);
+      exit(1);
+    }
+  }
+  close(done[0]);
+  for(i = 0; i < NPIPE*PER; i++){
+    wait(&xstatus);
+    if(xstatus != 0){
+      printf("%s: a reader failed\n", s);
+      exit(1);
+    }
+  }
+  kill(wpid);
+  wait(0);
+}
+
+// CPU time this process has used, in TIMEFREQ units.
+uint64
+myruntime(void)
+{
+  static struct procinfo pi[NPROC];
+  int i, n;
+
+  n = procinfo(pi, NPROC);
+  for(i = 0; i < n; i++)
+    if(pi[i].pid == getpid())
+      return pi[i].runtime;
+  printf("myruntime: procinfo didn't list this process\n");
+  exit(1);
+}
+
+// a burst of forks, each child forking and waiting for a
+// grandchild and then burning CPU, should all be reaped, and
+// should spread over the CPUs rather than queue on the one
+// that forked them. assumes more than one CPU, as make qemu
+// gives by default.
+void
+forkstormtest(char *s)
+{
+  enum { N = 12 };
+  uint64 burn, t0, t1;
+  int i, pid, wpid, xstatus;
+
+  burn = TIMEFREQ / 20;
+  wpid = watchdog(getpid(), 20);
+  t0 = rdtime();
+  for(i = 0; i < N; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      pid = fork();
+      if(pid < 0)
+        exit(1);
+      if(pid == 0)
+        exit(0);
+      if(wait(0) != pid)
+        exit(1);
+      while(myruntime() < burn)
+        ;
+      exit(0);
+    }
+  }
+  for(i = 0; i < N; i++){
+    wait(&xstatus);
+    if(xstatus != 0){
+      printf("%s: a child failed\n", s);
+      exit(1);
+    }
+  }
+  t1 = rdtime();
+  kill(wpid);
+  wait(0);
+
+  if(t1 - t0 > N * burn * 4 / 5){
+    printf("%s: %d children of %l cycles each took %l cycles\n",
+           s, N, burn, t1 - t0);
+    exit(1);
+  }
+}
+
+// CPU-bound processes at nice 0 should get much more CPU
+// time than as many at nice 19 competing with them.
+void
+nicesharetest(char *s)
+{
+  enum { N = 4 };
+  static struct procinfo pi[NPROC];
+  int pids[2*N], i, j, n;
+  uint64 fast, slow;
+
+  for(i = 0; i < 2*N; i++){
+    pids[i] = fork();
+    if(pids[i] < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pids[i] == 0){
+      if(setnice(getpid(), i % 2 ? NICE_MAX : 0) != 0)
+        exit(1);
+      for(;;)
+        ;
+    }
+  }
+  sleep(TICKHZ);
+
+  fast = slow = 0;
+  n = procinfo(pi, NPROC);
+  for(i = 0; i < 2*N; i++){
+    for(j = 0; j < n; j++)
+      if(pi[j].pid == pids[i])
+        break;
+    if(j == n){
+      printf("%s: procinfo didn't list child %d\n", s, pids[i]);
+      exit(1);
+    }
+    if(i % 2)
+      slow += pi[j].runtime;
+    else
+      fast += pi[j].runtime;
+  }
+  for(i = 0; i < 2*N; i++){
+    kill(pids[i]);
+    wait(0);
+  }
+
+  if(fast < slow * 2){
+    printf("%s: nice 0 got %l, nice %d got %l\n", s, fast, NICE_MAX, slow);
+    exit(1);
+  }
+}
+
+// written by asidtest's children; a fresh image must see 0.
+int asidval;
+
+// a child's writes to its copy of a page, or to the old image
+// after exec, must never show through a TLB entry left under
+// an ASID that a new address space has been given.
+void
+asidtest(char *s)
+{
+  char *args[] = { "usertests", "-asid", 0 };
+  int i, pid, xstatus;
+
+  for(i = 0; i < 20; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      if(asidval != 0)
+        exit(1);
+      asidval = 0x55 + i;
+      exit(0);
+    }
+    wait(&xstatus);
+    if(xstatus != 0 || asidval != 0){
+      printf("%s: saw a write from another address space\n", s);
+      exit(1);
+    }
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    asidval = 0x55;
+    exec(args[0], args);
+    printf("%s: exec failed\n", s);
+    exit(2);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: exec'd image saw the old image's write\n", s);
+    exit(1);
+  }
+}
+
+// small blocks of every size keep their contents and don't
+// overlap, and freeing a big block hands it back to the kernel.
+void
+malloctest(char *s)
+{
+  static char *p[1100];
+  char *top;
+  int i, j;
+
+  for(i = 0; i < 1100; i++){
+    if((p[i] = malloc(i)) == 0){
+      printf("%s: malloc(%d) failed\n", s, i);
+      exit(1);
+    }
+    memset(p[i], i, i);
+  }
+  for(i = 0; i < 1100; i += 2)
+    free(p[i]);
+  for(i = 1; i < 1100; i += 2)
+    for(j = 0; j < i; j++)
+      if(p[i][j] != (char)i){
+        printf("%s: malloc(%d) block overwritten\n", s, i);
+        exit(1);
+      }
+  for(i = 1; i < 1100; i += 2)
+    free(p[i]);
+
+  top = sbrk(0);
+  if((p[0] = malloc(1024*1024)) == 0){
+    printf("%s: malloc of 1 MiB failed\n", s);
+    exit(1);
+  }
+  free(p[0]);
+  if(sbrk(0) > top + 4096){
+    printf("%s: free didn't shrink the heap\n", s);
+    exit(1);
+  }
+}
+
 struct test {
   void (*f)(char *);
   char *s;
@@ -2635,6 +3252,15 @@ struct test {
   {sbrklast, "sbrklast"},
   {sbrk8000, "sbrk8000"},
   {badarg, "badarg" },
+  {mmaptest, "mmaptest" },
+  {lockstattest, "lockstattest" },
+  {nicetest, "nicetest" },
+  {clocktest, "clocktest" },
+  {wakeuptest, "wakeuptest" },
+  {forkstormtest, "forkstormtest" },
+  {nicesharetest, "nicesharetest" },
+  {asidtest, "asidtest" },
+  {malloctest, "malloctest" },
 
   { 0, 0},
 };
@@ -3081,6 +3707,10 @@ main(int argc, char *argv[])
   int quick = 0;
   char *justone = 0;
 
+  // asidtest's exec'd image: its bss must start out zero.
+  if(argc == 2 && strcmp(argv[1], "-asid") == 0)
+    exit(asidval != 0);
+
   if(argc == 2 && strcmp(argv[1], "-q") == 0){
     quick = 1;
   } else if(argc == 2 && strcmp(argv[1], "-c") == 0){
@@ -6,24 +6,27 @@ print "# generated by usys.pl - do not edit\n";
 
 print "#include \"kernel/syscall.h\"\n";
 
+# entry("name", "sym") names the stub sym instead of name,
+# for calls that ulib.c wraps.
 sub entry {
     my $name = shift;
-    print ".global $name\n";
-    print "${name}:\n";
+    my $sym = shift || $name;
+    print ".global $sym\n";
+    print "${sym}:\n";
     print " li a7, SYS_${name}\n";
     print " ecall\n";
     print " ret\n";
 }
 	
-entry("fork");
-entry("exit");
+entry("fork", "_fork");
+entry("exit", "_exit");
 entry("wait");
 entry("pipe");
 entry("read");
-entry("write");
-entry("close");
+entry("write", "_write");
+entry("close", "_close");
 entry("kill");
-entry("exec");
+entry("exec", "_exec");
 entry("open");
 entry("mknod");
 entry("unlink");
@@ -31,9 +34,21 @@ entry("fstat");
 entry("link");
 entry("mkdir");
 entry("chdir");
-entry("dup");
+entry("dup", "_dup");
 entry("getpid");
 entry("sbrk");
 entry("sleep");
 entry("uptime");
 entry("mkguest");
+entry("mmap");
+entry("munmap");
+entry("lockstat");
+entry("setnice");
+entry("procinfo");
+entry("clock_gettime");
+entry("nanosleep");
+entry("balloon");
+entry("vmsave");
+entry("vmrestore");
+entry("vmdirty");
+entry("vmsend");
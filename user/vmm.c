@@ -2,13 +2,20 @@
 #include "kernel/stat.h"
 #include "user/user.h"
 
+// usage: vmm [nice]
 int
 main(int argc, char *argv[])
 {
-  if (mkguest("guest", 16*1024*1024) < 0) {
+  int nice = 0;
+
+  if (argc > 1)
+    nice = argv[1][0] == '-' ? -atoi(argv[1] + 1) : atoi(argv[1]);
+  int pid = mkguest("guest", 16*1024*1024, nice);
+  if (pid <= 0) {
     printf("Error creating a guest OS\n");
     exit(1);
   }
+  printf("guest pid %d\n", pid);  // for balloon
 
   int status;
   wait(&status);
@@ -0,0 +1,110 @@
+// Save a running guest to a file, or start one from a file.
+// usage: vmsnap save pid file
+//        vmsnap restore file
+//        vmsnap dirty pid [seconds]
+//        vmsnap migrate pid
+// A saved guest carries on running. A restored guest starts
+// where the snapshot left it, without booting; vmsnap waits
+// for it to exit, as vmm does. dirty shows how many pages a
+// guest writes each second, which is what a checkpoint after
+// a full save would have to write. migrate moves a running
+// guest, over a pipe, to a child vmsnap that restores it and
+// waits for it, as vmm does; the kernel prints the downtime
+// when the copy first runs.
+
+#include "kernel/types.h"
+#include "kernel/fcntl.h"
+#include "kernel/param.h"
+#include "kernel/memlayout.h"
+#include "user/user.h"
+
+static uchar bits[4096];  // a bit per page, for 128 MiB
+
+int
+main(int argc, char *argv[])
+{
+  int fd, pid, status, i, n;
+  uint64 t0;
+
+  if(argc == 4 && strcmp(argv[1], "save") == 0){
+    pid = atoi(argv[2]);
+    if((fd = open(argv[3], O_CREATE|O_TRUNC|O_WRONLY)) < 0){
+      fprintf(2, "vmsnap: cannot create %s\n", argv[3]);
+      exit(1);
+    }
+    t0 = rdtime();
+    if(vmsave(pid, fd) < 0){
+      fprintf(2, "vmsnap: cannot save guest %d\n", pid);
+      exit(1);
+    }
+    printf("guest %d saved in %l ms\n", pid, (rdtime() - t0) / (TIMEFREQ / 1000));
+    close(fd);
+    exit(0);
+  }
+
+  if(argc == 3 && strcmp(argv[1], "restore") == 0){
+    if((fd = open(argv[2], O_RDONLY)) < 0){
+      fprintf(2, "vmsnap: cannot open %s\n", argv[2]);
+      exit(1);
+    }
+    if((pid = vmrestore(fd)) <= 0){
+      fprintf(2, "vmsnap: %s is not a snapshot\n", argv[2]);
+      exit(1);
+    }
+    close(fd);
+    printf("guest pid %d\n", pid);
+    wait(&status);
+    exit(status != 0);
+  }
+
+  if((argc == 3 || argc == 4) && strcmp(argv[1], "dirty") == 0){
+    pid = atoi(argv[2]);
+    n = argc == 4 ? atoi(argv[3]) : 1;
+    if(vmdirty(pid, bits, sizeof(bits)) < 0){
+      fprintf(2, "vmsnap: cannot track guest %d\n", pid);
+      exit(1);
+    }
+    for(i = 0; i < n; i++){
+      sleep(TICKHZ);
+      printf("guest %d: %d pages written\n", pid, vmdirty(pid, bits, sizeof(bits)));
+    }
+    exit(0);
+  }
+
+  if(argc == 3 && strcmp(argv[1], "migrate") == 0){
+    int fds[2];
+
+    pid = atoi(argv[2]);
+    if(pipe(fds) < 0){
+      fprintf(2, "vmsnap: pipe failed\n");
+      exit(1);
+    }
+    if(fork() == 0){
+      close(fds[1]);
+      if((pid = vmrestore(fds[0])) <= 0){
+        fprintf(2, "vmsnap: migration failed\n");
+        exit(1);
+      }
+      close(fds[0]);
+      printf("guest pid %d\n", pid);
+      wait(&status);
+      exit(status != 0);
+    }
+    close(fds[0]);
+    t0 = rdtime();
+    n = vmsend(pid, fds[1]);
+    close(fds[1]);  // ends a failed migration for the child
+    if(n < 0){
+      fprintf(2, "vmsnap: cannot migrate guest %d\n", pid);
+      wait(0);
+      exit(1);
+    }
+    printf("guest %d sent in %d rounds, %l ms\n", pid, n, (rdtime() - t0) / (TIMEFREQ / 1000));
+    wait(&status);
+    exit(status != 0);
+  }
+
+  fprintf(2, "usage: vmsnap save pid file\n       vmsnap restore file\n"
+          "       vmsnap dirty pid [seconds]\n       vmsnap migrate pid\n");
+  exit(1);
+}
@@ -0,0 +1,91 @@
+// Measure the cost of sleep/wakeup as the number of other
+// sleeping processes grows. A parent and child bounce a byte
+// over two pipes, each hop a wakeup; meanwhile k idle children
+// sleep in read() on pipes of their own.
+
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "kernel/memlayout.h"
+#include "user/user.h"
+
+#define ROUNDS 5000
+
+// start k processes that sleep, each reading its own
+// empty pipe, until killed.
+void
+idlers(int k, int *pids)
+{
+  int fds[2], i;
+  char c;
+
+  for(i = 0; i < k; i++){
+    pids[i] = fork();
+    if(pids[i] < 0){
+      fprintf(2, "wakebench: fork failed\n");
+      exit(1);
+    }
+    if(pids[i] == 0){
+      if(pipe(fds) < 0)
+        exit(1);
+      read(fds[0], &c, 1);
+      exit(0);
+    }
+  }
+}
+
+// nanoseconds per round trip between two processes.
+uint64
+pingpong(void)
+{
+  int ab[2], ba[2], i;
+  uint64 t0, t;
+  char c = 0;
+
+  if(pipe(ab) < 0 || pipe(ba) < 0){
+    fprintf(2, "wakebench: pipe failed\n");
+    exit(1);
+  }
+  int pid = fork();
+  if(pid < 0){
+    fprintf(2, "wakebench: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    for(i = 0; i < ROUNDS; i++){
+      read(ab[0], &c, 1);
+      write(ba[1], &c, 1);
+    }
+    exit(0);
+  }
+  t0 = rdtime();
+  for(i = 0; i < ROUNDS; i++){
+    write(ab[1], &c, 1);
+    read(ba[0], &c, 1);
+  }
+  t = (rdtime() - t0) * (1000000000 / TIMEFREQ) / ROUNDS;
+  wait(0);
+  close(ab[0]);
+  close(ab[1]);
+  close(ba[0]);
+  close(ba[1]);
+  return t;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int pids[NPROC];
+  int k, i;
+
+  // each idler holds a process slot and two open files.
+  for(k = 0; k + 8 <= NPROC && 2*k + 8 <= NFILE; k += 12){
+    idlers(k, pids);
+    sleep(1);
+    printf("%d sleepers: %l ns per round trip\n", k, pingpong());
+    for(i = 0; i < k; i++){
+      kill(pids[i]);
+      wait(0);
+    }
+  }
+  exit(0);
+}